@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -22,34 +22,208 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "memlayout.h"
+#include "slab.h"
 
-struct {
+// The cache is a hash table of buffers, keyed by device and
+// block number, with a spinlock per bucket, so that looking up
+// and releasing different blocks doesn't contend on one lock.
+// A buffer is recycled by a clock hand sweeping over all the
+// buffers: one that has been used since the hand last passed
+// (b->used) gets a second chance.
+//
+// Buffers are allocated as blocks are first read, until the
+// cache holds 1/BCACHEFRAC of RAM; after that, buffers are
+// recycled. When kalloc() runs out of memory, bshrink() frees
+// the buffers not in use, down to NBUFMIN. If every buffer is
+// in use and no more can be allocated, bget() waits for one
+// to be released.
+
+#define NBUCKET 13
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf head;  // bufs hashing here, through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes adding and recycling buffers
+  struct buf *hand;      // clock hand, in the circle of all buffers
+  int nbuf;              // number of buffers
+  int maxbuf;            // most the cache may grow to
+  int waiting;           // bget()s waiting for a buffer
+  struct kmem_cache cache;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket*
+bucketof(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+static void
+link(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+static void
+unlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+static void
+bufctor(void *o)
+{
+  initsleeplock(&((struct buf*)o)->lock, "buffer");
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  kmem_cache_init(&bcache.cache, "buf", sizeof(struct buf), bufctor);
+  // count whole slab pages, not just the data blocks: a
+  // buffer's header and the slab's spare room use RAM too.
+  bcache.maxbuf = (PHYSTOP - KERNBASE) / BCACHEFRAC / PGSIZE *
+                  bcache.cache.nobj;
+  if(bcache.maxbuf < NBUFMIN)
+    bcache.maxbuf = NBUFMIN;
+}
+
+// Allocate a new buffer, with one reference, unless the
+// cache is as big as it may get or memory is short.
+// Caller must hold bcache.lock.
+static struct buf*
+newbuf(void)
+{
+  struct buf *b;
+
+  if(bcache.nbuf >= bcache.maxbuf ||
+     (b = kmem_cache_alloc(&bcache.cache)) == 0)
+    return 0;
+  bcache.nbuf++;
+  b->refcnt = 1;
+  b->disk = 0;
+  // put it just behind the hand, to be looked at last.
+  if(bcache.hand == 0){
+    b->cnext = b->cprev = b;
+    bcache.hand = b;
+  } else {
+    b->cnext = bcache.hand;
+    b->cprev = bcache.hand->cprev;
+    b->cprev->cnext = b;
+    bcache.hand->cprev = b;
+  }
+  return b;
+}
+
+// Find the cached buffer for dev and blockno in bk.
+// Caller must hold bk->lock.
+static struct buf*
+find(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Find the cached buffer for dev and blockno in bk, and
+// take a reference to it.
+// Caller must hold bk->lock.
+static struct buf*
+lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = find(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    b->used = 1;
   }
+  return b;
+}
+
+// Take an unused buffer out of the hash table for reuse,
+// with one reference. Returns 0 if all are in use.
+// Caller must hold bcache.lock, which keeps every buffer's
+// dev and blockno, and so its bucket, from changing.
+static struct buf*
+recycle(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+  int i;
+
+  // the first sweep may only clear b->used.
+  for(i = 0; i < 2*bcache.nbuf; i++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    bk = bucketof(b->dev, b->blockno);
+    acquire(&bk->lock);
+    // a buf being filled by breadahead() has no
+    // references, but isn't free.
+    if(b->refcnt == 0 && !b->disk){
+      if(b->used){
+        b->used = 0;
+      } else {
+        unlink(b);
+        b->refcnt = 1;
+        release(&bk->lock);
+        return b;
+      }
+    }
+    release(&bk->lock);
+  }
+  return 0;
+}
+
+// Free the buffers that aren't in use, down to NBUFMIN,
+// when memory runs short.
+// Caller must not hold any spinlock.
+void
+bshrink(void)
+{
+  struct bucket *bk;
+  struct buf *b;
+  int i, n;
+
+  acquire(&bcache.lock);
+  n = bcache.nbuf;
+  for(i = 0; i < n && bcache.nbuf > NBUFMIN; i++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    bk = bucketof(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt != 0 || b->disk){
+      release(&bk->lock);
+      continue;
+    }
+    unlink(b);
+    release(&bk->lock);
+    b->cprev->cnext = b->cnext;
+    b->cnext->cprev = b->cprev;
+    if(--bcache.nbuf == 0)
+      bcache.hand = 0;
+    kmem_cache_free(&bcache.cache, b);
+  }
+  release(&bcache.lock);
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +232,81 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk = bucketof(dev, blockno);
   struct buf *b;
 
-  acquire(&bcache.lock);
-
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
+  acquire(&bk->lock);
+  b = lookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    goto found;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+  // Not cached. Only one process at a time adds a buffer,
+  // so look again in case another just added this block.
+  acquire(&bcache.lock);
+  for(;;){
+    // count this bget() as waiting before looking at the
+    // buffers, so that a brelse() after they've been looked
+    // at wakes it up.
+    bcache.waiting++;
+    acquire(&bk->lock);
+    b = lookup(bk, dev, blockno);
+    release(&bk->lock);
+    if(b == 0 && ((b = newbuf()) != 0 || (b = recycle()) != 0)){
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      b->used = 1;
+      acquire(&bk->lock);
+      link(bk, b);
+      release(&bk->lock);
     }
+    if(b){
+      bcache.waiting--;
+      break;
+    }
+    sleep(&bcache, &bcache.lock);
+    bcache.waiting--;
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+
+ found:
+  acquiresleep(&b->lock);
+  // breadahead() may not have finished filling b.
+  if(b->disk)
+    virtio_disk_wait(b);
+  return b;
+}
+
+// Return a locked buffer, not yet valid, for a block that
+// isn't cached, without sleeping. Returns 0 if the block is
+// cached or there is no buffer to spare.
+static struct buf*
+bgetnowait(uint dev, uint blockno)
+{
+  struct bucket *bk = bucketof(dev, blockno);
+  struct buf *b = 0;
+  int cached;
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  cached = find(bk, dev, blockno) != 0;
+  release(&bk->lock);
+  if(!cached && ((b = newbuf()) != 0 || (b = recycle()) != 0)){
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->used = 1;
+    // no one else can find b until it's linked,
+    // so this doesn't sleep.
+    acquiresleep(&b->lock);
+    acquire(&bk->lock);
+    link(bk, b);
+    release(&bk->lock);
+  }
+  release(&bcache.lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,8 +317,9 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+    b->ioblock = b->blockno;
+    blkq_submitv(&b, 1, 0);
+    bwait(b);
   }
   return b;
 }
@@ -108,11 +330,97 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  b->ioblock = b->blockno;
+  blkq_submitv(&b, 1, 1);
+  bwait(b);
+}
+
+// Start writing b's contents to disk, without waiting.
+// Must be locked, and stay locked until bwait() returns.
+void
+bwrite_async(struct buf *b)
+{
+  bwritev(&b, 1);
+}
+
+// Start writing the n locked bufs in b[], without waiting.
+void
+bwritev(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+    b[i]->ioblock = b[i]->blockno;
+  }
+  blkq_submitv(b, n, 1);
+}
+
+// Start writing the contents of the n locked bufs in b[] to
+// the n consecutive blocks starting at blockno, rather than
+// to their own blocks, without waiting. The bufs stay as
+// they were in the cache.
+void
+bwritevat(struct buf **b, int n, uint blockno)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritevat");
+    b[i]->ioblock = blockno + i;
+  }
+  blkq_submitv(b, n, 1);
+}
+
+// Start reading the n blocks of dev in blockno[] into the
+// cache, without waiting, skipping those already cached.
+// n must be at most MAXIOBLOCKS.
+void
+breadahead(uint dev, uint *blockno, int n)
+{
+  struct buf *b[MAXIOBLOCKS];
+  int i, nb;
+
+  for(i = nb = 0; i < n; i++){
+    if((b[nb] = bgetnowait(dev, blockno[i])) != 0){
+      b[nb]->ioblock = b[nb]->blockno;
+      nb++;
+    }
+  }
+  blkq_submitv(b, nb, 0);
+  for(i = 0; i < nb; i++)
+    brelse(b[i]);
+}
+
+// Wait for I/O started on b to finish.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Drop a reference to b, waking up a bget()
+// waiting for a buffer if it was the last.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+  int last;
+
+  acquire(&bk->lock);
+  last = --b->refcnt == 0;
+  release(&bk->lock);
+
+  if(last && bcache.waiting){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +428,53 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
 }
 
 
+
+// Return a locked copy of locked buffer b, for writing b's
+// contents while b is released and changed. The copy isn't
+// in the cache; give it back with bfreecopy(). Returns 0 if
+// memory is short.
+struct buf*
+bsnapshot(struct buf *b)
+{
+  struct buf *c;
+
+  if(!holdingsleep(&b->lock))
+    panic("bsnapshot");
+  if((c = kmem_cache_alloc(&bcache.cache)) == 0)
+    return 0;
+  acquiresleep(&c->lock);
+  c->dev = b->dev;
+  c->blockno = b->blockno;
+  c->valid = 1;
+  c->disk = 0;
+  c->refcnt = 1;
+  memmove(c->data, b->data, BSIZE);
+  return c;
+}
+
+void
+bfreecopy(struct buf *c)
+{
+  if(!holdingsleep(&c->lock))
+    panic("bfreecopy");
+  releasesleep(&c->lock);
+  kmem_cache_free(&bcache.cache, c);
+}
@@ -0,0 +1,111 @@
+//
+// Block I/O queue, between the buffer cache and the disk driver.
+//
+// bio.c queues its reads and writes here rather than starting
+// them itself. Whenever the disk has room for another request,
+// blkq_dispatch() picks one from the queue, which is kept sorted
+// by block number: requests go to the disk in ascending order,
+// sweeping up from the last block dispatched and then starting
+// again from the bottom, so that scattered writes (installing
+// the log, bitmap and inode blocks) become a sequential pass
+// over the disk. A request takes the queued bufs for the blocks
+// that follow its own along with it, as long as they go the same
+// way, so that the disk sees one request per run of blocks.
+//
+// So that requests far from the sweep can't wait forever, one
+// that has been queued for DEADLINE ticks goes next.
+//
+// Lock order: blkq.lock, then the driver's vdisk_lock.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define DEADLINE 5  // ticks a request may be queued before it goes next
+
+struct {
+  struct spinlock lock;
+  struct buf *head;  // queued bufs, sorted by ioblock, through qnext
+  uint pos;          // block after the last one dispatched
+} blkq;
+
+void
+blkqinit(void)
+{
+  initlock(&blkq.lock, "blkq");
+}
+
+// Queue the n bufs in b[] to be read from or written to
+// their b[i]->ioblock, and give the disk what it has room
+// for. Each b[i]->disk is set until the disk is done with
+// b[i], and a completed read sets b[i]->valid. The caller
+// must keep the bufs from being reused until then, e.g. by
+// holding their sleeplocks.
+void
+blkq_submitv(struct buf **b, int n, int write)
+{
+  struct buf **pp;
+  int i;
+
+  acquire(&blkq.lock);
+  for(i = 0; i < n; i++){
+    b[i]->disk = 1;
+    b[i]->qwrite = write;
+    b[i]->qtime = ticks;
+    for(pp = &blkq.head; *pp && (*pp)->ioblock < b[i]->ioblock; pp = &(*pp)->qnext)
+      ;
+    b[i]->qnext = *pp;
+    *pp = b[i];
+  }
+  release(&blkq.lock);
+
+  blkq_dispatch();
+}
+
+// Give queued requests to the disk until the queue is empty
+// or the disk has no room for the next one; in that case
+// virtio_disk_intr() calls again when a request completes.
+void
+blkq_dispatch(void)
+{
+  struct buf **pp, **first, **oldest, *b, *run[MAXIOBLOCKS];
+  int n;
+
+  acquire(&blkq.lock);
+  while(blkq.head){
+    // the next request starts at the first buf at or above
+    // pos, or at the bottom; or at the oldest, if it's overdue.
+    first = oldest = 0;
+    for(pp = &blkq.head; *pp; pp = &(*pp)->qnext){
+      if(first == 0 && (*pp)->ioblock >= blkq.pos)
+        first = pp;
+      if(oldest == 0 || ticks - (*pp)->qtime > ticks - (*oldest)->qtime)
+        oldest = pp;
+    }
+    if(ticks - (*oldest)->qtime >= DEADLINE)
+      first = oldest;
+    else if(first == 0)
+      first = &blkq.head;
+
+    // merge the bufs for the blocks that follow.
+    b = *first;
+    n = 0;
+    do {
+      run[n++] = b;
+      b = b->qnext;
+    } while(b && n < MAXIOBLOCKS && b->dev == run[0]->dev &&
+            b->qwrite == run[0]->qwrite && b->ioblock == run[n-1]->ioblock + 1);
+
+    if(virtio_disk_trystart(run, n, run[0]->qwrite) < 0)
+      break;
+    *first = b;
+    blkq.pos = run[n-1]->ioblock + 1;
+  }
+  release(&blkq.lock);
+}
@@ -5,8 +5,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int used;    // used since the clock hand last passed?
+  struct buf *prev; // hash bucket list
   struct buf *next;
+  struct buf *cprev; // circle of all buffers, for the clock
+  struct buf *cnext;
+  uint ioblock; // disk block for I/O on data; usually blockno
+  struct buf *qnext; // next in the block queue, or rest of a disk request
+  int qwrite;  // queued to be written, rather than read?
+  uint qtime;  // ticks when queued
   uchar data[BSIZE];
 };
 
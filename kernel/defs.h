@@ -2,20 +2,36 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct memstat;
 struct pipe;
+struct shmseg;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
 
+// blkq.c
+void            blkqinit(void);
+void            blkq_submitv(struct buf**, int, int);
+void            blkq_dispatch(void);
+
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwritev(struct buf**, int);
+void            bwritevat(struct buf**, int, uint);
+void            breadahead(uint, uint*, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bshrink(void);
+struct buf*     bsnapshot(struct buf*);
+void            bfreecopy(struct buf*);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +40,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -46,6 +63,7 @@ void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+void            ireap(void);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
@@ -63,14 +81,42 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kaddref(void *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            ksplit(void *);
+void*           kalloc_zeroed(void);
+void            kprezero(void);
+uint64          kfreepages(void);
+void            kfreev(void**, int);
+void            kmemstat(struct memstat*);
+
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            kmem_cache_reap(void);
+void            kmem_cache_stat(struct memstat*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
+
+// mmap.c
+uint64          mmap(uint64, uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+int             mmapfault(pagetable_t, uint64, int);
+int             mmapcopy(struct proc*, struct proc*);
+void            munmapall(struct proc*);
+uint64          mmapbase(struct proc*);
+uint64          mmapshm(struct shmseg*, uint64);
+int             shmdt(uint64);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -82,9 +128,12 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+uint64          procasid(struct proc*);
+void            proctlbflush(struct proc*);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, int*, int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -100,6 +149,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kproc(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -110,10 +160,28 @@ void            trace(uint64);
 int             waitx(uint64, uint*, uint*);
 void            updateTime(void);
 int             set_priority(uint64, uint64);
+int             procmem(uint64, int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// swap.c
+void            swapinit(void);
+int             swapout(int);
+int             swapin(pagetable_t, uint64);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+void            swapstat(struct memstat*);
+void            kswapd(void);
+
+// shm.c
+void            shminit(void);
+int             shmget(char*, uint64);
+uint64          shmat(int);
+void            shmdup(struct shmseg*);
+void            shmput(struct shmseg*);
+uint64          shmpage(struct shmseg*, uint64);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -165,15 +233,24 @@ void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
+pagetable_t     uvmcreateproc(uint64);
+void            uvmfreeproc(pagetable_t, uint64);
+void            uvmreap(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmclear(pagetable_t, uint64);
+int             uvmprefault(pagetable_t, uint64, uint64, int);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walkmega(pagetable_t, uint64);
+int             mapmega(pagetable_t, uint64, uint64, int);
+int             copymega(pagetable_t, pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          uvmstat(pagetable_t, uint64*, uint64*);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -187,6 +264,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_startv(struct buf **, int, int);
+int             virtio_disk_trystart(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
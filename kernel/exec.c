@@ -19,17 +19,20 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Replace p's user image with the program at path, with
+// arguments argv. p is either the caller or, for spawn(), a
+// new process that isn't running yet.
+// Returns argc, or -1 leaving p as it was.
 int
-exec(char *path, char **argv)
+execproc(struct proc *p, char *path, char **argv)
 {
-  char *s, *last;
-  int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  char *s, *last, *hdr = 0, *stack;
+  int i, n, off;
+  uint64 argc, len, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -39,9 +42,13 @@ exec(char *path, char **argv)
   }
   ilock(ip);
 
-  // Check ELF header
-  if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
+  // Read the start of the file, which normally holds the
+  // program headers as well as the ELF header, in one go.
+  if((hdr = kalloc()) == 0)
+    goto bad;
+  if((n = readi(ip, 0, (uint64)hdr, 0, PGSIZE)) < (int)sizeof(elf))
     goto bad;
+  elf = *(struct elfhdr*)hdr;
 
   if(elf.magic != ELF_MAGIC)
     goto bad;
@@ -51,7 +58,9 @@ exec(char *path, char **argv)
 
   // Load program into memory.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
-    if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
+    if(off >= 0 && off + sizeof(ph) <= n)
+      ph = *(struct proghdr*)(hdr + off);
+    else if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
     if(ph.type != ELF_PROG_LOAD)
       continue;
@@ -71,8 +80,9 @@ exec(char *path, char **argv)
   iunlockput(ip);
   end_op();
   ip = 0;
+  kfree(hdr);
+  hdr = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -83,20 +93,26 @@ exec(char *path, char **argv)
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
+  if(uvmclear(pagetable, sz-2*PGSIZE) != 0)
+    goto bad;
   sp = sz;
   stackbase = sp - PGSIZE;
 
+  // The stack page is new and not yet in use, so build
+  // it directly in its physical memory.
+  if((stack = (char*)walkaddr(pagetable, stackbase)) == 0)
+    goto bad;
+
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
       goto bad;
-    sp -= strlen(argv[argc]) + 1;
+    len = strlen(argv[argc]) + 1;
+    sp -= len;
     sp -= sp % 16; // riscv sp must be 16-byte aligned
     if(sp < stackbase)
       goto bad;
-    if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
+    memmove(stack + (sp - stackbase), argv[argc], len);
     ustack[argc] = sp;
   }
   ustack[argc] = 0;
@@ -106,8 +122,7 @@ exec(char *path, char **argv)
   sp -= sp % 16;
   if(sp < stackbase)
     goto bad;
-  if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
-    goto bad;
+  memmove(stack + (sp - stackbase), (char *)ustack, (argc+1)*sizeof(uint64));
 
   // arguments to user main(argc, argv)
   // argc is returned via the system call return
@@ -120,10 +135,13 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image, dropping the old image's
+  // mmap() regions along with it.
+  munmapall(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  proctlbflush(p);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
@@ -131,6 +149,8 @@ exec(char *path, char **argv)
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
+  if(hdr)
+    kfree(hdr);
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
@@ -140,6 +160,12 @@ exec(char *path, char **argv)
   return -1;
 }
 
+int
+exec(char *path, char **argv)
+{
+  return execproc(myproc(), path, argv);
+}
+
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
@@ -18,6 +18,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // on itable list
+  struct inode *lprev; // on itable LRU list, if ref == 0
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,6 +30,10 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint ranext;        // block a sequential readi() would start in
+  uint raend;         // first block not yet read ahead
+  int rawin;          // readahead window, in blocks; 0 if off
 };
 
 // map major device number to device functions.
@@ -15,6 +15,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "slab.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -130,17 +131,17 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   is unused, and may be freed, if ip->ref is zero.
+//   Otherwise ip->ref tracks the number of in-memory
+//   pointers to the entry (open files and current
+//   directories). iget() finds or creates a table entry
+//   and increments its ref; iput() decrements ref.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,10 +165,17 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// In-memory inodes are allocated from a slab cache by iget()
+// and kept on the itable list. The last iput() doesn't free
+// a valid inode but moves it to the LRU list, so that iget()
+// finds it again without reading the disk. The least recently
+// used one is freed once more than NICACHE are unreferenced,
+// and ireap() frees them all when kalloc() runs out of memory.
+//
+// The itable.lock spin-lock protects the itable list. Since
+// ip->ref indicates whether an entry is in use, and ip->dev and
+// ip->inum indicate which i-node an entry holds, one must hold
+// itable.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -175,22 +183,78 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *list;   // all in-memory inodes
+  struct inode lru;     // those with ref == 0, most recently used first
+  int nlru;
+  struct kmem_cache cache;
 } itable;
 
+static void
+inodector(void *p)
+{
+  initsleeplock(&((struct inode*)p)->lock, "inode");
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.lru.lprev = &itable.lru;
+  itable.lru.lnext = &itable.lru;
+  kmem_cache_init(&itable.cache, "inode", sizeof(struct inode), inodector);
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Remove ip from the LRU list.
+// Caller must hold itable.lock.
+static void
+lruunlink(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  itable.nlru--;
+}
+
+// Free unreferenced inode ip.
+// Caller must hold itable.lock.
+static void
+ifree(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.list; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  kmem_cache_free(&itable.cache, ip);
+}
+
+// Free the least recently used unreferenced inode.
+// Returns 0 if there is none.
+// Caller must hold itable.lock.
+static int
+ievict(void)
+{
+  struct inode *ip = itable.lru.lprev;
+
+  if(ip == &itable.lru)
+    return 0;
+  lruunlink(ip);
+  ifree(ip);
+  return 1;
+}
+
+// Free all the unreferenced inodes, when memory runs short.
+// Caller must not hold itable.lock.
+void
+ireap(void)
+{
+  acquire(&itable.lock);
+  while(ievict())
+    ;
+  release(&itable.lock);
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
@@ -246,31 +310,34 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.list; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruunlink(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Allocate an inode entry.
+  while((ip = kmem_cache_alloc(&itable.cache)) == 0)
+    if(!ievict())
+      panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->rawin = 0;
+  ip->next = itable.list;
+  itable.list = ip;
   release(&itable.lock);
 
   return ip;
@@ -357,7 +424,18 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    if(ip->valid){
+      ip->lnext = itable.lru.lnext;
+      ip->lprev = &itable.lru;
+      ip->lnext->lprev = ip;
+      itable.lru.lnext = ip;
+      if(++itable.nlru > NICACHE)
+        ievict();
+    } else {
+      ifree(ip);
+    }
+  }
   release(&itable.lock);
 }
 
@@ -464,6 +542,53 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Readahead window, in blocks.
+#define RAMIN 4
+#define RAMAX MAXIOBLOCKS
+
+// Called by readi() before reading [off, off+n) of ip. If ip
+// is being read sequentially, start reading the blocks the
+// reader will want next into the buffer cache. The window
+// starts at RAMIN blocks and doubles, up to RAMAX, each time
+// the reader moves on to another block; a read anywhere else
+// closes it again.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, last, end, addr[RAMAX];
+  int i;
+
+  bn = off / BSIZE;
+  last = (off + n - 1) / BSIZE;
+  if(bn != ip->ranext && bn + 1 != ip->ranext){
+    // not sequential.
+    ip->ranext = last + 1;
+    ip->raend = 0;
+    ip->rawin = 0;
+    return;
+  }
+  if(last + 1 == ip->ranext)
+    return;  // still in the block the last read ended in
+  ip->ranext = last + 1;
+  ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+
+  // read ahead again once the reader is half way
+  // through what was read ahead last time.
+  if(ip->raend >= ip->ranext + ip->rawin/2)
+    return;
+  if(ip->raend < bn)
+    ip->raend = bn;
+  end = min(ip->ranext + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  end = min(end, ip->raend + RAMAX);
+  for(i = 0; ip->raend < end; ip->raend++){
+    if((addr[i] = bmap(ip, ip->raend)) == 0)
+      break;
+    i++;
+  }
+  breadahead(ip->dev, addr, i);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -478,6 +603,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -1,6 +1,26 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// A buddy allocator: free memory is kept in blocks of 2^order
+// contiguous pages, each aligned to its own size, on one free
+// list per order. kalloc_pages() splits a larger block if no
+// block of the wanted order is free; freeing a block merges it
+// with its buddy (the other half of the next larger block) for
+// as long as the buddy is free too. kalloc() and kfree() deal in
+// single 4096-byte pages (order 0).
+//
+// Memory that has never been allocated is not put on the free
+// lists at boot; it is kept as the range [kmem.wild, PHYSTOP),
+// and carve() moves blocks from it to the free lists only when
+// the lists can't satisfy an allocation. So booting doesn't
+// touch every page of RAM.
+//
+// CPUs with nothing to run zero free pages ahead of time into a
+// small pool (see kprezero()), from which kalloc_zeroed() hands
+// out pages without zeroing them on the allocation path. Pages
+// are only filled with junk when the kernel is built with
+// KALLOC_JUNK (make KALLOCJUNK=1).
 
 #include "types.h"
 #include "param.h"
@@ -8,58 +28,328 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
-
-void freerange(void *pa_start, void *pa_end);
+#include "memstat.h"
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define MAXORDER 10  // largest block is 2^MAXORDER pages
+#define NZEROED 256  // size of the pool of pre-zeroed pages
+
+// a free block, linked on kmem.free[order].
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+// index of the page holding physical address pa in kmem.ref[].
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i) (KERNBASE + (uint64)(i) * PGSIZE)
+#define NPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+
+// kmem.block[] entries, for pages that start a block.
+#define BLK_FREE 0x40
+#define BLK_USED 0x80
+#define BLK_ORDER(b) ((b) & 0x3f)
+
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run free[MAXORDER+1];  // list heads, one per order
+
+  // BLK_FREE or BLK_USED and the order of the block that
+  // starts at each page; 0 for pages inside a block.
+  uchar block[NPAGES];
+
+  // number of page tables mapping each allocated block,
+  // so that a block can be shared (e.g. by a MAP_SHARED
+  // mmap() inherited across fork()). Kept for the block's
+  // first page.
+  int ref[NPAGES];
+
+  uint64 wild;         // start of memory not yet carved
+  uint64 nfree;        // pages on the free lists
+  uint64 allocs;       // blocks handed out since boot
+  uint64 fails;        // and allocations that failed
+
+  struct run *zeroed;  // pool of pre-zeroed pages, linked by next
+  int nzeroed;         // pages in the pool, or being zeroed for it
 } kmem;
 
+static void
+push(struct run *r, int order)
+{
+  struct run *h = &kmem.free[order];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.block[PA2IDX(r)] = BLK_FREE | order;
+  kmem.nfree += 1L << order;
+}
+
+static void
+unlink(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree -= 1L << BLK_ORDER(kmem.block[PA2IDX(r)]);
+  kmem.block[PA2IDX(r)] = 0;
+}
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(i = 0; i <= MAXORDER; i++)
+    kmem.free[i].next = kmem.free[i].prev = &kmem.free[i];
+  kmem.wild = PGROUNDUP((uint64)end);
 }
 
+// Check that pa starts an allocated block, and
+// return the block's order.
+// Caller must hold kmem.lock.
+static int
+blockorder(void *pa, char *s)
+{
+  uchar b;
+
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic(s);
+  b = kmem.block[PA2IDX(pa)];
+  if((b & BLK_USED) == 0 || kmem.ref[PA2IDX(pa)] < 1)
+    panic(s);
+  return BLK_ORDER(b);
+}
+
+// Add a reference to the allocated block at pa, which
+// a subsequent kfree() will drop rather than free.
 void
-freerange(void *pa_start, void *pa_end)
+kaddref(void *pa)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&kmem.lock);
+  blockorder(pa, "kaddref");
+  kmem.ref[PA2IDX(pa)]++;
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Turn the allocated block at pa into single pages, each
+// holding the block's references, so that they can be
+// freed one at a time.
+void
+ksplit(void *pa)
+{
+  uint64 i, n;
+  int ref;
+
+  acquire(&kmem.lock);
+  n = 1L << blockorder(pa, "ksplit");
+  ref = kmem.ref[PA2IDX(pa)];
+  for(i = PA2IDX(pa); i < PA2IDX(pa) + n; i++){
+    kmem.block[i] = BLK_USED;
+    kmem.ref[i] = ref;
+  }
+  release(&kmem.lock);
+}
+
+// Return block i, of the given order, to the free lists,
+// merging it with its buddies.
+// Caller must hold kmem.lock.
+static void
+freeblock(uint64 i, int order)
+{
+  uint64 buddy;
+
+  kmem.block[i] = 0;
+  for(; order < MAXORDER; order++){
+    buddy = i ^ (1L << order);
+    if(buddy >= NPAGES || kmem.block[buddy] != (BLK_FREE | order))
+      break;
+    unlink((struct run*)IDX2PA(buddy));
+    i &= ~(1L << order);
+  }
+  push((struct run*)IDX2PA(i), order);
+}
+
+// Drop a reference to the block of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc() or kalloc_pages(), and free it once no
+// references remain.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  int order, ref;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("kfree");
+  acquire(&kmem.lock);
+  order = blockorder(pa, "kfree");
+  ref = --kmem.ref[PA2IDX(pa)];
+  release(&kmem.lock);
+  if(ref > 0)
+    return;
 
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  freeblock(PA2IDX(pa), order);
+  release(&kmem.lock);
+}
+
+// kfree() each of the n blocks in pa[], taking
+// kmem.lock just once.
+void
+kfreev(void **pa, int n)
+{
+  int i, order;
 
-  r = (struct run*)pa;
+#ifdef KALLOC_JUNK
+  for(i = 0; i < n; i++)
+    kfree(pa[i]);
+  return;
+#endif
 
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  for(i = 0; i < n; i++){
+    order = blockorder(pa[i], "kfreev");
+    if(--kmem.ref[PA2IDX(pa[i])] == 0)
+      freeblock(PA2IDX(pa[i]), order);
+  }
+  release(&kmem.lock);
+}
+
+// Free the 2^order pages at pa, which should have
+// been returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  acquire(&kmem.lock);
+  if(blockorder(pa, "kfree_pages") != order)
+    panic("kfree_pages: order");
   release(&kmem.lock);
+  kfree(pa);
+}
+
+// Move the next block of never-used memory to the free
+// lists: the largest block that starts at kmem.wild.
+// Returns 0 if there is none left.
+// Caller must hold kmem.lock.
+static int
+carve(void)
+{
+  uint64 i = PA2IDX(kmem.wild);
+  int order;
+
+  if(kmem.wild + PGSIZE > PHYSTOP)
+    return 0;
+  for(order = 0; order < MAXORDER; order++){
+    if((i & (1L << order)) || kmem.wild + (PGSIZE << (order+1)) > PHYSTOP)
+      break;
+  }
+  kmem.wild += PGSIZE << order;
+  freeblock(i, order);
+  return 1;
+}
+
+// Take a free block of the given order off the free lists,
+// splitting a larger one if need be.
+// Caller must hold kmem.lock.
+static struct run*
+takeblock(int order)
+{
+  struct run *r = 0;
+  int o;
+
+  do {
+    for(o = order; o <= MAXORDER; o++){
+      if(kmem.free[o].next != &kmem.free[o]){
+        r = kmem.free[o].next;
+        unlink(r);
+        break;
+      }
+    }
+  } while(r == 0 && carve());
+  if(r){
+    // give back the upper halves until the block is
+    // the size asked for.
+    while(o > order){
+      o--;
+      push((struct run*)((char*)r + (PGSIZE << o)), o);
+    }
+    kmem.block[PA2IDX(r)] = BLK_USED | order;
+    kmem.ref[PA2IDX(r)] = 1;
+  }
+  return r;
+}
+
+// Give the pre-zeroed pool back to the free lists, so that
+// its pages can be allocated and merged again.
+// Caller must hold kmem.lock.
+static void
+drainzeroed(void)
+{
+  struct run *r;
+
+  while((r = kmem.zeroed) != 0){
+    kmem.zeroed = r->next;
+    kmem.nzeroed--;
+    kmem.ref[PA2IDX(r)] = 0;
+    freeblock(PA2IDX(r), 0);
+  }
+}
+
+static struct run*
+allocblock(int order)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  if((r = takeblock(order)) == 0){
+    drainzeroed();
+    r = takeblock(order);
+  }
+  if(r)
+    kmem.allocs++;
+  release(&kmem.lock);
+  return r;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size. Returns a pointer that the kernel
+// can use. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  if((r = allocblock(order)) == 0 && intr_get()){
+    // with interrupts on the caller holds no spinlocks
+    // (see push_off()), so the buffer cache, the inode cache,
+    // the slab caches and the cache of page tables can safely give back their
+    // spare pages.
+    bshrink();
+    ireap();
+    uvmreap();
+    kmem_cache_reap();
+    r = allocblock(order);
+  }
+  if(r == 0){
+    acquire(&kmem.lock);
+    kmem.fails++;
+    release(&kmem.lock);
+  }
+
+#ifdef KALLOC_JUNK
+  if(r)
+    memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -67,16 +357,80 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  return kalloc_pages(0);
+}
+
+// Allocate one 4096-byte page filled with zeros,
+// preferably from the pre-zeroed pool.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
 {
   struct run *r;
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  if((r = kmem.zeroed) != 0){
+    kmem.zeroed = r->next;
+    kmem.nzeroed--;
+    kmem.allocs++;
+  }
   release(&kmem.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    memset(r, 0, sizeof(*r)); // the pool's link
+  } else if((r = kalloc()) != 0){
+    memset(r, 0, PGSIZE);
+  }
   return (void*)r;
 }
+
+// Return the number of pages that could be allocated:
+// free, never used, or in the pre-zeroed pool.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+
+  acquire(&kmem.lock);
+  n = kmem.nfree + (PHYSTOP - kmem.wild) / PGSIZE + kmem.nzeroed;
+  release(&kmem.lock);
+  return n;
+}
+
+// Fill in the allocator's part of *ms.
+void
+kmemstat(struct memstat *ms)
+{
+  ms->total = (PHYSTOP - PGROUNDUP((uint64)end)) / PGSIZE;
+  ms->free = kfreepages();
+  acquire(&kmem.lock);
+  ms->zeroed = kmem.nzeroed;
+  ms->allocs = kmem.allocs;
+  ms->fails = kmem.fails;
+  release(&kmem.lock);
+}
+
+// Zero a free page into the pool, unless it is full.
+// Called by the scheduler on a CPU with nothing to run,
+// to take zeroing off the allocation path.
+void
+kprezero(void)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  if(kmem.nzeroed >= NZEROED || (r = takeblock(0)) == 0){
+    release(&kmem.lock);
+    return;
+  }
+  kmem.nzeroed++;
+  release(&kmem.lock);
+
+  memset(r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zeroed;
+  kmem.zeroed = r;
+  release(&kmem.lock);
+}
@@ -10,31 +10,76 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is committed only once it is closed and
+// no FS system calls in it are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if it thinks the log is close to running out, it closes
+// the transaction and sleeps until the transaction has been
+// handed to the flusher.
+//
+// Group commit: a transaction stays open, gathering system
+// calls, until its log space might run out or until it has
+// been open for COMMITTICKS, when logd closes it. So a burst
+// of small updates (e.g. creating many files) shares a commit.
+// The price is durability: a system call such as write(),
+// link() or unlink() returns before its updates are on the
+// disk, and a crash loses those of the last COMMITTICKS or so,
+// plus any flush in progress. The file system stays consistent,
+// since a transaction is replayed whole or not at all.
+//
+// Commits are done by the logflush kernel process, not by the
+// system calls, so end_op() never waits for the disk. Once a
+// closed transaction's last system call has ended, logflush
+// copies its blocks out of the buffer cache, lets the next
+// transaction start gathering system calls, writes the copies
+// to the log, and then writes them home in sorted batches.
+// The next transaction's system calls may change the cached
+// blocks meanwhile. If a copy can't be allocated, logflush
+// holds that block's buffer until it is home instead, and a
+// system call that uses the block waits for the flush. The
+// cached blocks stay pinned until they are home, so a read
+// can't see the old contents on disk. The next commit doesn't
+// start until the flush is done, which keeps the log's
+// blocks from being overwritten before they are home.
+//
+// A program that needs its updates on the disk calls sync():
+// log_sync() closes the open transaction and waits until it,
+// and any commit in progress, are home.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   header block, containing the transaction's sequence number,
+//     block #s for block A, B, C, ..., a checksum of each
+//     block's contents, and a checksum of the header
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A commit writes the header and the blocks together, as one
+// batch, and the transaction is committed once all of them are
+// on the disk; recovery replays the log only if every checksum
+// matches. Then the blocks are written home, all at once.
+//
+// The log is never erased. Replaying the last committed
+// transaction again is harmless: all of its blocks are home
+// before the next transaction overwrites the log, and only
+// commits write home blocks.
+
+#define COMMITTICKS 1  // ticks a transaction may stay open
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;            // transaction sequence number
   int n;
   int block[LOGSIZE];
+  uint sum[LOGSIZE];   // checksums of the logged blocks
+  uint hsum;           // checksum of the header up to here
 };
 
 struct log {
@@ -42,14 +87,22 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // transaction takes no more sys calls.
+  uint opened;     // ticks when the transaction logged its first block.
   int dev;
-  struct logheader lh;
+  uint seq;        // sequence number of the last commit.
+  uint homeseq;    // sequence number of the last commit that is home.
+  struct logheader lh;   // the open transaction
+  struct logheader clh;  // the one being committed
+  struct buf *cbuf[LOGSIZE]; // clh's blocks, pinned in the cache
+  struct buf *wbuf[LOGSIZE]; // copies of cbuf[] to write, or cbuf[] itself
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logd(void);
+static void logflush(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -60,66 +113,91 @@ initlog(int dev, struct superblock *sb)
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  if(log.size > LOGSIZE + 1)
+    log.size = LOGSIZE + 1;
   log.dev = dev;
   recover_from_log();
+  kproc("logd", logd);
+  kproc("logflush", logflush);
+}
+
+// FNV-1a hash of the n bytes at p, continuing from h.
+static uint
+fnv(uint h, void *p, int n)
+{
+  uchar *c = p;
+
+  while(n-- > 0)
+    h = (h ^ *c++) * 16777619;
+  return h;
+}
+
+// Checksum of a logged block's data, in transaction seq.
+static uint
+blocksum(uint seq, uchar *data)
+{
+  return fnv(fnv(2166136261, &seq, sizeof(seq)), data, BSIZE);
+}
+
+static uint
+headsum(struct logheader *h)
+{
+  return fnv(2166136261, h, (char*)&h->hsum - (char*)h);
 }
 
 // Copy committed blocks from log to their home location
 static void
-install_trans(int recovering)
+install_trans(void)
 {
+  struct buf *dbuf[LOGSIZE];
   int tail;
 
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+    dbuf[tail] = bread(log.dev, log.lh.block[tail]); // read dst
+    memmove(dbuf[tail]->data, lbuf->data, BSIZE);  // copy block to dst
     brelse(lbuf);
-    brelse(dbuf);
+  }
+  bwritev(dbuf, log.lh.n);  // write dsts to disk, in block order
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
-// Read the log header from disk into the in-memory log header
-static void
+// Read the log header from disk into the in-memory log header,
+// and check the header and the logged blocks. Returns 1 if
+// they hold a committed transaction, 0 if not (e.g. a commit
+// was cut short, or the log has never been used).
+static int
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
-  brelse(buf);
-}
+  int i, ok;
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
-{
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
+  log.lh = *lh;
+  log.seq = lh->seq;
+  brelse(buf);
+  if (log.lh.hsum != headsum(&log.lh) || log.lh.n < 0 || log.lh.n > log.size - 1)
+    return 0;
   for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+    buf = bread(log.dev, log.start+i+1);
+    ok = blocksum(log.lh.seq, buf->data) == log.lh.sum[i];
+    brelse(buf);
+    if (!ok)
+      return 0;
   }
-  bwrite(buf);
-  brelse(buf);
+  return 1;
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
+  if (read_head())
+    install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  log.homeseq = log.seq;
 }
 
 // called at the start of each FS system call.
@@ -128,10 +206,14 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size - 1){
+      // this op might exhaust log space; close the
+      // transaction and wait for it to be flushed.
+      log.closing = 1;
+      if(log.outstanding == 0)
+        wakeup(&log.clh);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -142,19 +224,16 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// hands a closed transaction to logflush if this was
+// its last outstanding operation. doesn't wait for the
+// commit; use log_sync() for that.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  if(log.outstanding == 0 && log.closing){
+    wakeup(&log.clh);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -162,44 +241,145 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// Close the open transaction once it has been open for
+// COMMITTICKS, so that updates reach the disk soon even
+// when the log doesn't fill up.
+static void
+logd(void)
+{
+  for(;;){
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    if(!log.closing && log.lh.n > 0 && ticks - log.opened >= COMMITTICKS){
+      log.closing = 1;
+      if(log.outstanding == 0)
+        wakeup(&log.clh);
+    }
     release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Commit each closed transaction once its last
+// sys call has ended.
+static void
+logflush(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(!log.closing || log.outstanding > 0)
+      sleep(&log.clh, &log.lock);
+    commit();
+  }
+}
+
+// Write the header, and the copies of the modified blocks,
+// to the log as one run of consecutive blocks. This is
+// the true point at which the transaction commits. The log
+// blocks are never read through the cache, except by recovery
+// at boot.
 static void
 write_log(void)
 {
+  struct buf *b[LOGSIZE+1];
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
+  for (tail = 0; tail < log.clh.n; tail++)
+    log.clh.sum[tail] = blocksum(log.clh.seq, log.wbuf[tail]->data);
+  log.clh.hsum = headsum(&log.clh);
+
+  b[0] = bread(log.dev, log.start);
+  *(struct logheader *) (b[0]->data) = log.clh;
+  for (tail = 0; tail < log.clh.n; tail++)
+    b[tail+1] = log.wbuf[tail];
+  bwritevat(b, log.clh.n+1, log.start);
+  for (tail = 0; tail <= log.clh.n; tail++)
+    bwait(b[tail]);
+  brelse(b[0]);
 }
 
+// Write the committed blocks to their home locations.
+static void
+write_home(void)
+{
+  int tail;
+
+  bwritev(log.wbuf, log.clh.n);
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwait(log.wbuf[tail]);
+}
+
+// Commit the closed transaction, whose sys calls have all
+// ended. Called by logflush with log.lock held; releases
+// it while writing to the disk.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int i;
+
+  log.clh = log.lh;
+  log.clh.seq = ++log.seq;
+  log.lh.n = 0;
+  release(&log.lock);
+
+  // copy the blocks before the next transaction starts.
+  for (i = 0; i < log.clh.n; i++) {
+    log.cbuf[i] = bread(log.dev, log.clh.block[i]);
+    if ((log.wbuf[i] = bsnapshot(log.cbuf[i])) != 0)
+      brelse(log.cbuf[i]);
+    else
+      log.wbuf[i] = log.cbuf[i];
+  }
+
+  acquire(&log.lock);
+  log.closing = 0;
+  wakeup(&log);
+  release(&log.lock);
+
+  if (log.clh.n > 0) {
+    write_log();     // Write header and blocks to log -- the real commit
+    write_home();    // Now install writes to home locations
+    for (i = 0; i < log.clh.n; i++) {
+      if (log.wbuf[i] != log.cbuf[i])
+        bfreecopy(log.wbuf[i]);
+      else
+        brelse(log.wbuf[i]);
+      bunpin(log.cbuf[i]);
+    }
+  }
+
+  acquire(&log.lock);
+  log.homeseq = log.clh.seq;
+  wakeup(&log.homeseq);
+}
+
+// Wait until the updates of every FS system call that has
+// already ended are home on the disk. Closes the open
+// transaction rather than waiting for logd to. Must not be
+// called inside a transaction.
+void
+log_sync(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  if(log.lh.n > 0){
+    // the open transaction will be the next commit.
+    seq++;
+    if(!log.closing){
+      log.closing = 1;
+      if(log.outstanding == 0)
+        wakeup(&log.clh);
+    }
   }
+  while((int)(seq - log.homeseq) > 0)
+    sleep(&log.homeseq, &log.lock);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -229,8 +409,9 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    if (log.lh.n == 0)
+      log.opened = ticks;
     log.lh.n++;
   }
   release(&log.lock);
 }
-
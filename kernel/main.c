@@ -11,6 +11,7 @@ void
 main()
 {
   if(cpuid() == 0){
+    uint64 boot = r_time();
     consoleinit();
     printfinit();
     printf("\n");
@@ -25,10 +26,17 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    blkqinit();      // block I/O queue
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    shminit();       // shared memory segments
     virtio_disk_init(); // emulated hard disk
+    swapinit();      // swap area
     userinit();      // first user process
+    kproc("kswapd", kswapd); // paging daemon
+    // qemu's time CSR counts at 10 MHz.
+    printf("xv6 kernel booted in %d us\n", (int)((r_time() - boot) / 10));
     __sync_synchronize();
     started = 1;
   } else {
@@ -0,0 +1,23 @@
+// Memory usage, as reported by the memstat()
+// and procmem() system calls.
+
+struct memstat {
+  uint64 total;      // pages of RAM managed by kalloc()
+  uint64 free;       // pages that could be allocated
+  uint64 zeroed;     // free pages already zeroed
+  uint64 allocs;     // blocks allocated since boot
+  uint64 fails;      // allocations that failed
+  uint64 swaptotal;  // swap slots, one page each
+  uint64 swapused;   // slots in use
+  uint64 cachehits[NCPU];  // slab allocations from each CPU's magazines
+};
+
+struct procmem {
+  int pid;
+  int state;         // enum procstate
+  char name[16];
+  uint64 sz;         // size of user memory (bytes)
+  uint64 rss;        // resident user pages
+  uint64 swapped;    // pages swapped out
+  uint64 ptpages;    // page-table pages
+};
@@ -0,0 +1,455 @@
+//
+// Memory-mapped regions: mmap() and munmap().
+//
+// Each process describes its mappings with the NVMA slots in
+// p->vma[]. Regions are placed top-down beneath MMAPTOP, above
+// the heap, and are populated lazily: mmap() only records the
+// region, and the first touch of each page faults into
+// mmapfault(), which allocates the page and, for a file-backed
+// region, fills it from the file with readi(). munmap() writes
+// the dirty pages of a MAP_SHARED file mapping back with writei()
+// before releasing them.
+//
+// Shared memory segments (shm.c) are attached as MAP_SHARED
+// regions whose pages come from the segment instead of a file.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Return the region of p containing va, or 0.
+static struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// Return an unused region slot of p, or 0.
+static struct vma*
+allocvma(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      return v;
+  }
+  return 0;
+}
+
+// The PTE permissions for pages of region v.
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Lowest address used by p's mappings, which bounds
+// the growth of its heap.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && v->addr < base)
+      base = v->addr;
+  }
+  return base;
+}
+
+// Find room for a len-byte region, searching down
+// from MMAPTOP. Regions of a megapage or more are
+// megapage-aligned, so that they can use megapages.
+// Returns 0 if there is no room above the heap.
+static uint64
+mmapaddr(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 a, align;
+
+  align = len >= MEGAPGSIZE ? MEGAPGSIZE : PGSIZE;
+  a = (MMAPTOP - len) & ~(align - 1);
+again:
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && a < v->addr + v->len && v->addr < a + len){
+      if(v->addr < len)
+        return 0;
+      a = (v->addr - len) & ~(align - 1);
+      goto again;
+    }
+  }
+  if(a < PGROUNDUP(p->sz))
+    return 0;
+  return a;
+}
+
+// Create a mapping of len bytes in the current process.
+// f is the backing file, or 0 for an anonymous mapping.
+// addr is only a hint and is ignored.
+// Returns the address of the mapping, or -1.
+uint64
+mmap(uint64 addr, uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(len == 0 || len > MMAPTOP || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  len = PGROUNDUP(len);
+  if((v = allocvma(p)) == 0)
+    return -1;
+  if((addr = mmapaddr(p, len)) == 0)
+    return -1;
+
+  v->addr = addr;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags & (MAP_SHARED|MAP_PRIVATE);
+  v->f = f ? filedup(f) : 0;
+  v->shm = 0;
+  v->off = off;
+  return addr;
+}
+
+// Attach shared memory segment s, of len bytes, to the
+// current process. The caller has already counted the
+// attachment in s.
+// Returns the address of the new region, or -1.
+uint64
+mmapshm(struct shmseg *s, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 addr;
+
+  if((v = allocvma(p)) == 0)
+    return -1;
+  if((addr = mmapaddr(p, len)) == 0)
+    return -1;
+
+  v->addr = addr;
+  v->len = len;
+  v->prot = PROT_READ|PROT_WRITE;
+  v->flags = MAP_SHARED;
+  v->f = 0;
+  v->shm = s;
+  v->off = 0;
+  return addr;
+}
+
+// Write the page at pa, mapped at va in region v, back
+// to v's file. Stops at the end of the file, so that a
+// mapping that extends past it doesn't grow the file.
+static void
+mmapwriteback(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->f->ip;
+  uint off = v->off + (va - v->addr);
+  // the same limit on blocks per transaction as filewrite().
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    begin_op();
+    ilock(ip);
+    n = 0;
+    if(off + i < ip->size){
+      n = min(min(PGSIZE - i, max), ip->size - (off + i));
+      if(writei(ip, 0, pa + i, off + i, n) != n)
+        n = 0;
+    }
+    iunlock(ip);
+    end_op();
+    if(n == 0)
+      break;
+  }
+}
+
+// Remove the pages of [va, va+len) in region v from pagetable,
+// writing back dirty pages of a shared file mapping. Only
+// anonymous private regions have megapages; the caller must
+// have split any that is partly removed (see uvmsplit()).
+static void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 a, n, pa;
+  pte_t *pte;
+
+  for(a = va; a < va + len; a += n){
+    n = PGSIZE;
+    if(a % MEGAPGSIZE == 0 && va + len - a >= MEGAPGSIZE &&
+       (pte = walkmega(pagetable, a)) != 0)
+      n = MEGAPGSIZE;
+    else if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    if(v->f && (v->flags & MAP_SHARED) && (*pte & PTE_D))
+      mmapwriteback(v, a, pa);
+    *pte = 0;
+    kfree((void*)pa);
+  }
+}
+
+// Release region v's reference to its file or segment,
+// and mark the slot unused.
+static void
+vmafree(struct vma *v)
+{
+  if(v->f)
+    fileclose(v->f);
+  if(v->shm)
+    shmput(v->shm);
+  memset(v, 0, sizeof(*v));
+}
+
+// Remove [addr, addr+len) from the current process's mappings.
+// The range must lie within a single region; unmapping its
+// middle splits the region in two.
+// Returns 0 on success, -1 on error.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+  uint64 end;
+
+  len = PGROUNDUP(len);
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  if((v = findvma(p, addr)) == 0 || addr + len > v->addr + v->len)
+    return -1;
+
+  end = addr + len;
+  // vmaunmap() can't fail, so split megapages first.
+  if(uvmsplit(p->pagetable, addr) != 0 || uvmsplit(p->pagetable, end) != 0)
+    return -1;
+  if(addr > v->addr && end < v->addr + v->len){
+    if((nv = allocvma(p)) == 0)
+      return -1;
+    *nv = *v;
+    nv->addr = end;
+    nv->len = v->addr + v->len - end;
+    nv->off = v->off + (end - v->addr);
+    if(nv->f)
+      filedup(nv->f);
+    if(nv->shm)
+      shmdup(nv->shm);
+    v->len = end - v->addr;
+  }
+
+  vmaunmap(p->pagetable, v, addr, len);
+  proctlbflush(p);
+
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0)
+    vmafree(v);
+  return 0;
+}
+
+// Detach the shared memory segment attached at addr.
+// Returns 0 on success, -1 on error.
+int
+shmdt(uint64 addr)
+{
+  struct vma *v;
+
+  if((v = findvma(myproc(), addr)) == 0 || v->shm == 0 || v->addr != addr)
+    return -1;
+  return munmap(v->addr, v->len);
+}
+
+// Remove all of p's mappings, as on exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    vmaunmap(p->pagetable, v, v->addr, v->len);
+    vmafree(v);
+  }
+  proctlbflush(p);
+}
+
+// Populate the page containing va for an access needing the PTE
+// permission access (PTE_R, PTE_W or PTE_X), if va lies in one
+// of the current process's mappings. Called for page faults from
+// usertrap(), and by copyin()/copyout() for untouched pages.
+// Returns 0 if the page is now mapped, -1 if the access is bad.
+int
+mmapfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a;
+  char *mem;
+  int n;
+
+  if(p == 0 || pagetable != p->pagetable || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((v = findvma(p, va)) == 0 || (vmaperm(v) & access) == 0)
+    return -1;
+  if(walkaddr(pagetable, va) != 0)
+    return -1; // already mapped: a genuine protection fault.
+
+  if(v->shm){
+    // map the segment's own page.
+    if((mem = (char*)shmpage(v->shm, (v->off + (va - v->addr)) / PGSIZE)) == 0)
+      return -1;
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, vmaperm(v)) != 0){
+      kfree(mem);
+      return -1;
+    }
+    goto mapped;
+  }
+
+  if(v->f == 0 && (v->flags & MAP_PRIVATE)){
+    // back the whole surrounding megapage, if it lies
+    // within the region and nothing in it is mapped yet.
+    a = MEGAPGROUNDDOWN(va);
+    if(a >= v->addr && a + MEGAPGSIZE <= v->addr + v->len &&
+       (mem = kalloc_pages(MEGAPGORDER)) != 0){
+      memset(mem, 0, MEGAPGSIZE);
+      if(mapmega(pagetable, a, (uint64)mem, vmaperm(v)) == 0)
+        goto mapped;
+      kfree(mem);
+    }
+  }
+
+  // filling from the file sleeps, which isn't allowed
+  // with a spinlock held (and so interrupts off).
+  if(v->f && intr_get() == 0)
+    return -1;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(v->f){
+    ilock(v->f->ip);
+    n = readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+    iunlock(v->f->ip);
+    if(n < 0){
+      kfree(mem);
+      return -1;
+    }
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, vmaperm(v)) != 0){
+    kfree(mem);
+    return -1;
+  }
+
+ mapped:
+  // a TLB may still hold the old, invalid PTE.
+  proctlbflush(p);
+  return 0;
+}
+
+// Give child np a copy of p's mappings, as part of fork().
+// Pages of shared mappings are shared with the parent;
+// pages of private ones are copied.
+// Returns 0 on success, -1 on failure, in which case
+// np is left with no mappings.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  uint64 a, n, pa;
+  pte_t *pte;
+  char *mem;
+  int flags;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->len == 0)
+      continue;
+    *nv = *v;
+    nv->f = 0;    // referenced once everything is copied.
+    nv->shm = 0;
+    for(a = v->addr; a < v->addr + v->len; a += n){
+      n = PGSIZE;
+      if(walkmega(p->pagetable, a)){
+        // a private anonymous megapage.
+        if(copymega(p->pagetable, np->pagetable, a) != 0)
+          goto err;
+        n = MEGAPGSIZE;
+        continue;
+      }
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte) & ~(PTE_A|PTE_D);
+      if(v->flags & MAP_SHARED){
+        kaddref((void*)pa);
+        mem = (char*)pa;
+      } else {
+        if((mem = kalloc()) == 0)
+          goto err;
+        memmove(mem, (char*)pa, PGSIZE);
+      }
+      if(mappages(np->pagetable, a, PGSIZE, (uint64)mem, flags) != 0){
+        kfree(mem);
+        goto err;
+      }
+    }
+  }
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->len && v->f)
+      nv->f = filedup(v->f);
+    if(v->len && v->shm){
+      shmdup(v->shm);
+      nv->shm = v->shm;
+    }
+  }
+  return 0;
+
+ err:
+  // nv->f is still 0, so nothing is written back.
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->len)
+      vmaunmap(np->pagetable, nv, nv->addr, nv->len);
+    memset(nv, 0, sizeof(*nv));
+  }
+  return -1;
+}
@@ -1,13 +1,20 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mmap() regions per process
+#define NSHM         16  // shared memory segments per system
+#define SHMNAME      16  // maximum shared memory segment name
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#ifndef LOGSIZE
+#define LOGSIZE      (MAXOPBLOCKS*8)  // max data blocks in on-disk log
+#endif
+#define NBUFMIN      (LOGSIZE*3)  // disk block cache never shrinks below
+#define BCACHEFRAC   8     // disk block cache grows to 1/BCACHEFRAC of RAM
+#define NICACHE      200   // most unreferenced inodes kept in memory
+#define MAXIOBLOCKS  32    // max blocks in one disk request
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPBLOCKS   16384 // size of swap area, after the file system
 #define MAXPATH      128   // maximum file path name
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "memstat.h"
 
 struct cpu cpus[NCPU];
 
@@ -102,6 +103,49 @@ allocpid()
   return pid;
 }
 
+// Return p's ASID on this CPU, handing out a fresh one if
+// p has none from the CPU's current generation. Once the
+// CPU's ASIDs run out a new generation starts with the whole
+// TLB flushed, so a reused ASID has no stale entries.
+// Returns 0, the kernel's, if the CPU has no ASIDs; userret
+// in trampoline.S then flushes the TLB on every switch.
+// Must be called with interrupts off.
+uint64
+procasid(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+
+  if(c->asidmax == 0)
+    return 0;
+  if(p->asidgen[id] != c->asidgen || c->asidgen == 0){
+    if(c->asidgen == 0 || c->asidnext > c->asidmax){
+      c->asidgen++;
+      c->asidnext = 1;
+      sfence_vma();
+    }
+    p->asid[id] = c->asidnext++;
+    p->asidgen[id] = c->asidgen;
+    // order earlier page-table writes before the
+    // hardware walks them for the new ASID.
+    sfence_vma_asid(p->asid[id]);
+  }
+  return p->asid[id];
+}
+
+// p's page table has changed in a way that may leave stale
+// entries in the TLB of any CPU p has run on. Rather than
+// flushing them, p gets a fresh ASID on each CPU when it
+// next returns to user space.
+void
+proctlbflush(struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    p->asidgen[i] = 0;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -124,6 +168,7 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  proctlbflush(p);
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -195,33 +240,7 @@ freeproc(struct proc *p)
 pagetable_t
 proc_pagetable(struct proc *p)
 {
-  pagetable_t pagetable;
-
-  // An empty page table.
-  pagetable = uvmcreate();
-  if(pagetable == 0)
-    return 0;
-
-  // map the trampoline code (for system call return)
-  // at the highest user virtual address.
-  // only the supervisor uses it, on the way
-  // to/from user space, so not PTE_U.
-  if(mappages(pagetable, TRAMPOLINE, PGSIZE,
-              (uint64)trampoline, PTE_R | PTE_X) < 0){
-    uvmfree(pagetable, 0);
-    return 0;
-  }
-
-  // map the trapframe page just below the trampoline page, for
-  // trampoline.S.
-  if(mappages(pagetable, TRAPFRAME, PGSIZE,
-              (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
-    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-    uvmfree(pagetable, 0);
-    return 0;
-  }
-
-  return pagetable;
+  return uvmcreateproc((uint64)(p->trapframe));
 }
 
 // Free a process's page table, and free the
@@ -229,9 +248,7 @@ proc_pagetable(struct proc *p)
 void
 proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
-  uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
-  uvmfree(pagetable, sz);
+  uvmfreeproc(pagetable, sz);
 }
 
 // a user program that calls exec("/init")
@@ -273,6 +290,35 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel process's very first scheduling by
+// scheduler() will swtch to kprocret.
+static void
+kprocret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kprocret");
+}
+
+// Start a kernel process, which runs fn (which must not
+// return) in the kernel and never goes to user space.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  p->kfn = fn;
+  p->context.ra = (uint64)kprocret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -283,13 +329,22 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
+    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+      // out of memory: swap out other processes' pages
+      // to make room, and try once more.
+      if(swapout(PGROUNDUP(n) / PGSIZE) == 0)
+        return -1;
+      if((sz = uvmalloc(p->pagetable, p->sz, p->sz + n, PTE_W)) == 0)
+        return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) != p->sz + n)
+      return -1;
   }
   p->sz = sz;
+  proctlbflush(p);
   return 0;
 }
 
@@ -315,6 +370,13 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // Copy mmap() regions.
+  if(mmapcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -347,6 +409,82 @@ fork(void)
   return pid;
 }
 
+// Create a process running the program at path with
+// arguments argv, without copying the caller's memory
+// as fork() and then exec() would. The child gets the
+// caller's open files, changed by the nact (fd, src)
+// pairs in act: the child's fd becomes a duplicate of
+// the caller's src, or is closed if src is -1.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, int *act, int nact)
+{
+  int i, fd, src, argc, pid;
+  struct file *f;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  for(i = 0; i < nact; i++){
+    fd = act[2*i];
+    src = act[2*i+1];
+    if(fd < 0 || fd >= NOFILE || src < -1 || src >= NOFILE ||
+       (src >= 0 && p->ofile[src] == 0))
+      return -1;
+  }
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  np->traceMask = p->traceMask;
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+  release(&np->lock);
+
+  // np isn't runnable yet, so nothing else uses its
+  // files or memory without np->lock.
+  for(i = 0; i < nact; i++){
+    fd = act[2*i];
+    src = act[2*i+1];
+    f = src >= 0 ? filedup(p->ofile[src]) : 0;
+    if(np->ofile[fd])
+      fileclose(np->ofile[fd]);
+    np->ofile[fd] = f;
+  }
+
+  if((argc = execproc(np, path, argv)) < 0){
+    for(i = 0; i < NOFILE; i++){
+      if(np->ofile[i]){
+        fileclose(np->ofile[i]);
+        np->ofile[i] = 0;
+      }
+    }
+    begin_op();
+    iput(np->cwd);
+    end_op();
+    np->cwd = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -373,6 +511,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Remove mmap() regions, writing back shared file pages.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -409,15 +550,23 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
+// Wait for a child process to exit and return its pid,
+// and its times if cpuRunTime and waitTime aren't 0.
 // Return -1 if this process has no children.
-int
-wait(uint64 addr)
+static int
+waitchild(uint64 addr, uint *cpuRunTime, uint *waitTime)
 {
   struct proc *pp;
   int havekids, pid;
   struct proc *p = myproc();
 
+ retry:
+  // copyout() can't read a swapped-out page back in, or
+  // populate an mmap()ed one, while spinlocks are held.
+  if(addr != 0 &&
+     uvmprefault(p->pagetable, addr, sizeof(pp->xstate), PTE_W) != 0)
+    return -1;
+
   acquire(&wait_lock);
 
   for(;;){
@@ -434,9 +583,14 @@ wait(uint64 addr)
           pid = pp->pid;
           if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
                                   sizeof(pp->xstate)) < 0) {
+            // swapped out again while we slept.
             release(&pp->lock);
             release(&wait_lock);
-            return -1;
+            goto retry;
+          }
+          if(cpuRunTime && waitTime){
+            *cpuRunTime = pp->cpuRunTime;
+            *waitTime = pp->endTime - pp->creationTime - pp->cpuRunTime;
           }
           freeproc(pp);
           release(&pp->lock);
@@ -458,6 +612,14 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return waitchild(addr, 0, 0);
+}
+
 // // Per-CPU process scheduler.
 // // Each CPU calls scheduler() after setting itself up.
 // // Scheduler never returns.  It loops, doing:
@@ -512,10 +674,12 @@ scheduler(void)
 
   #ifdef DEFAULT
   // printf("Inside default\n");
+  int found;
   for(;;){
       // Avoid deadlock by ensuring that devices can interrupt.
       intr_on();
 
+      found = 0;
       for(p = proc; p < &proc[NPROC]; p++) {
         acquire(&p->lock);
         if(p->state == RUNNABLE) {
@@ -523,6 +687,7 @@ scheduler(void)
           // to release its lock and then reacquire it
           // before jumping back to us.
           // printf("Process selected\n");
+          found = 1;
           p->noOfTimesGotCpu++;
           p->state = RUNNING;
           c->proc = p;
@@ -534,6 +699,10 @@ scheduler(void)
         }
         release(&p->lock);
       }
+
+      // nothing to run: zero pages for kalloc_zeroed().
+      if(!found)
+        kprezero();
     }
   #endif
 
@@ -582,6 +751,8 @@ scheduler(void)
       }
       release(&selectedProcess->lock);
     }
+    else
+      kprezero(); // nothing to run: zero pages for kalloc_zeroed().
   }
   #endif
 
@@ -645,6 +816,8 @@ scheduler(void)
       }
       release(&choosenProcess->lock);
     }
+    else
+      kprezero(); // nothing to run: zero pages for kalloc_zeroed().
   }
 
   #endif
@@ -707,6 +880,8 @@ scheduler(void)
       }
       release(&choosenProcess->lock);
     }
+    else
+      kprezero(); // nothing to run: zero pages for kalloc_zeroed().
   }
   #endif
 
@@ -902,6 +1077,39 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Copy the memory usage of up to n processes to the
+// array of struct procmem at user address addr.
+// Returns the number of processes copied, or -1.
+int
+procmem(uint64 addr, int n)
+{
+  struct proc *p;
+  struct procmem pm;
+  int i = 0;
+
+  for(p = proc; p < &proc[NPROC] && i < n; p++){
+    acquire(&p->lock);
+    if(p->state == UNUSED){
+      release(&p->lock);
+      continue;
+    }
+    memset(&pm, 0, sizeof(pm));
+    pm.pid = p->pid;
+    pm.state = p->state;
+    safestrcpy(pm.name, p->name, sizeof(pm.name));
+    pm.sz = p->sz;
+    if(p->pagetable)
+      pm.ptpages = uvmstat(p->pagetable, &pm.rss, &pm.swapped);
+    release(&p->lock);
+
+    // copyout() may have to swap in, so not under p->lock.
+    if(copyout(myproc()->pagetable, addr + i*sizeof(pm), (char*)&pm, sizeof(pm)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
+}
+
 // // Print a process listing to console.  For debugging.
 // // Runs when user types ^P on console.
 // // No lock to avoid wedging a stuck machine further.
@@ -1042,58 +1250,12 @@ updateTime(void)
   }
 }
 
-// Same as wait function
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Same as wait function, also returning the child's
+// run time and wait time.
 int
 waitx(uint64 addr, uint* cpuRunTime, uint* waitTime)
 {
-  struct proc *pp;
-  int havekids, pid;
-  struct proc *p = myproc();
-
-  acquire(&wait_lock);
-
-  for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          
-          *cpuRunTime = pp->cpuRunTime;
-          *waitTime = pp->endTime - pp->creationTime - pp->cpuRunTime;
-
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
-          release(&pp->lock);
-          release(&wait_lock);
-          return pid;
-        }
-        release(&pp->lock);
-      }
-    }
-
-    // No point waiting if we don't have any children.
-    if(!havekids || killed(p)){
-      release(&wait_lock);
-      return -1;
-    }
-    
-    // Wait for a child to exit.
-    sleep(p, &wait_lock);  //DOC: wait-sleep
-  }
+  return waitchild(addr, cpuRunTime, waitTime);
 }
 
 int set_priority(uint64 priority, uint64 pid)
@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint asidmax;               // Largest ASID this CPU implements, or 0.
+  uint asidnext;              // Next ASID to hand out.
+  uint64 asidgen;             // Generation of the ASIDs handed out, from 1.
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +82,18 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a process's address space created by mmap().
+// Pages are only mapped when first touched; see mmapfault().
+struct vma {
+  uint64 addr;                 // Start of region; len == 0 if slot unused
+  uint64 len;                  // Length in bytes, a multiple of PGSIZE
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Backing file, or 0 if anonymous
+  struct shmseg *shm;          // Backing shared memory segment, or 0
+  uint64 off;                  // Offset in file or segment that addr maps
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Set default static priority
@@ -113,7 +128,11 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Memory-mapped regions
+  uint asid[NCPU];             // ASID on each CPU, valid if asidgen matches
+  uint64 asidgen[NCPU];        // CPU's ASID generation when asid was given
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel process (see kproc())
 
   uint64 traceMask;            // Mask tracing 
 
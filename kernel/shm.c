@@ -0,0 +1,209 @@
+//
+// Named shared memory segments.
+//
+// shmget() looks up a segment by name, creating it if it does
+// not exist; shmat() maps a segment into the calling process as
+// an mmap() region, and shmdt() removes that region again.
+// Every process attached to a segment maps the same physical
+// pages, so data written by one is seen by the others without
+// copying.
+//
+// The segment holds a reference to each of its pages, and each
+// page table that maps one holds another (see kaddref()). A
+// segment lives as long as some region is attached to it;
+// detaching the last one frees it. Its pages are allocated by
+// the first shmat(), so a segment that has never been attached
+// holds no memory and nothing has been written to it; shmget()
+// frees such segments when it runs out of slots. An id carries
+// the slot's generation, so a stale id fails in shmat() rather
+// than attaching a newer segment in the same slot.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+
+#define SHMMAXPAGES (PGSIZE / sizeof(uint64))  // pages per segment
+#define SHMGENS     65536                     // generations per slot
+
+struct shmseg {
+  char name[SHMNAME];  // name[0] == 0 if slot unused
+  int npages;
+  int nattach;         // regions attached to this segment
+  uint gen;            // bumped each time the slot is freed
+  uint64 *pages;       // physical addresses, in a page of their own, or 0
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shmtable;
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shmtable");
+}
+
+// Free segment s and its pages.
+// Caller must hold shmtable.lock.
+static void
+shmfree(struct shmseg *s)
+{
+  int i;
+
+  if(s->pages){
+    for(i = 0; i < s->npages; i++)
+      kfree((void*)s->pages[i]);
+    kfree((void*)s->pages);
+  }
+  s->pages = 0;
+  s->npages = 0;
+  s->nattach = 0;
+  s->name[0] = 0;
+  s->gen = (s->gen + 1) % SHMGENS;
+}
+
+static int
+shmid(struct shmseg *s)
+{
+  return s->gen * NSHM + (s - shmtable.seg);
+}
+
+// Allocate s's zeroed pages, if it doesn't have them yet.
+// Caller must hold shmtable.lock.
+static int
+shmalloc(struct shmseg *s)
+{
+  char *mem;
+  int i;
+
+  if(s->pages)
+    return 0;
+  if((s->pages = kalloc()) == 0)
+    return -1;
+  for(i = 0; i < s->npages; i++){
+    if((mem = kalloc_zeroed()) == 0){
+      while(--i >= 0)
+        kfree((void*)s->pages[i]);
+      kfree((void*)s->pages);
+      s->pages = 0;
+      return -1;
+    }
+    s->pages[i] = (uint64)mem;
+  }
+  return 0;
+}
+
+// Return the id of the segment called name, creating it
+// with size bytes of zeroed memory if there is none.
+// Returns -1 if the existing segment is smaller than size,
+// or if the segment can't be created.
+int
+shmget(char *name, uint64 size)
+{
+  struct shmseg *s, *empty = 0;
+  int npages;
+
+  npages = PGROUNDUP(size) / PGSIZE;
+  if(name[0] == 0 || npages == 0 || npages > SHMMAXPAGES)
+    return -1;
+
+  acquire(&shmtable.lock);
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++){
+    if(s->name[0] && strncmp(s->name, name, SHMNAME) == 0){
+      release(&shmtable.lock);
+      return npages <= s->npages ? shmid(s) : -1;
+    }
+    if(empty == 0 && s->name[0] == 0)
+      empty = s;
+  }
+  if(empty == 0){
+    // free the segments that were never attached.
+    for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++){
+      if(s->name[0] && s->nattach == 0){
+        shmfree(s);
+        if(empty == 0)
+          empty = s;
+      }
+    }
+  }
+  if((s = empty) == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+
+  safestrcpy(s->name, name, SHMNAME);
+  s->npages = npages;
+  release(&shmtable.lock);
+  return shmid(s);
+}
+
+// Map segment id into the current process.
+// Returns the address of the new region, or -1.
+uint64
+shmat(int id)
+{
+  struct shmseg *s;
+  uint64 addr;
+
+  if(id < 0 || id >= SHMGENS * NSHM)
+    return -1;
+  s = &shmtable.seg[id % NSHM];
+
+  acquire(&shmtable.lock);
+  if(s->name[0] == 0 || s->gen != id / NSHM || shmalloc(s) < 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->nattach++;
+  release(&shmtable.lock);
+
+  if((addr = mmapshm(s, (uint64)s->npages * PGSIZE)) == -1)
+    shmput(s);
+  return addr;
+}
+
+// Record another region attached to s, as when a
+// region is split or inherited by fork().
+void
+shmdup(struct shmseg *s)
+{
+  acquire(&shmtable.lock);
+  if(s->nattach < 1)
+    panic("shmdup");
+  s->nattach++;
+  release(&shmtable.lock);
+}
+
+// A region attached to s has gone away.
+// Free s if it was the last one.
+void
+shmput(struct shmseg *s)
+{
+  acquire(&shmtable.lock);
+  if(s->nattach < 1)
+    panic("shmput");
+  if(--s->nattach == 0)
+    shmfree(s);
+  release(&shmtable.lock);
+}
+
+// Return the physical page at page index i of s,
+// with a reference added for the caller's mapping.
+// Returns 0 if i is beyond the end of s.
+uint64
+shmpage(struct shmseg *s, uint64 i)
+{
+  uint64 pa = 0;
+
+  acquire(&shmtable.lock);
+  if(i < s->npages){
+    pa = s->pages[i];
+    kaddref((void*)pa);
+  }
+  release(&shmtable.lock);
+  return pa;
+}
@@ -0,0 +1,240 @@
+//
+// Slab allocator for fixed-size kernel objects.
+//
+// A kmem_cache hands out objects of one size, carved out of
+// pages from kalloc() called slabs. Each slab starts with a
+// struct slab and is followed by as many objects as fit; free
+// objects in a slab are linked through a word that follows each
+// object, so that the object itself keeps the state set up by
+// the cache's constructor across kmem_cache_free() and the next
+// kmem_cache_alloc(). A slab goes back to kalloc() as soon as
+// none of its objects is in use.
+//
+// In front of the slabs each CPU keeps a magazine of free
+// objects. Allocating and freeing normally only touch the
+// current CPU's magazine; the cache's lock and slab lists are
+// used to refill a magazine that runs empty or to drain half of
+// one that fills up. kmem_cache_reap() empties every magazine
+// back into the slabs, and kalloc() calls it when it runs out
+// of pages.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "defs.h"
+#include "memstat.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;     // on cache->partial
+  struct slab *prev;
+  int inuse;             // objects allocated, or in a magazine
+  void *free;            // first free object
+};
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+// the free-list link of object o.
+#define LINK(c, o) (*(void**)((char*)(o) + (c)->size))
+
+static struct kmem_cache *caches;
+
+// Set up c to hand out size-byte objects, each prepared
+// by ctor (if not 0) when its slab is allocated.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size, void (*ctor)(void*))
+{
+  int i;
+
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->stride = c->size + sizeof(void*);
+  if(c->stride > PGSIZE - SLABHDR)
+    panic("kmem_cache_init: size");
+  c->nobj = (PGSIZE - SLABHDR) / c->stride;
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  c->partial = 0;
+  for(i = 0; i < NCPU; i++){
+    initlock(&c->mag[i].lock, "magazine");
+    c->mag[i].n = 0;
+  }
+
+  // caches are set up while booting, before the
+  // other CPUs start, so no lock is needed.
+  c->next = caches;
+  caches = c;
+}
+
+static void
+slabinsert(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+slabremove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Allocate a slab for c and carve it into free objects.
+static struct slab*
+newslab(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *o;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  for(i = c->nobj - 1; i >= 0; i--){
+    o = (char*)s + SLABHDR + i * c->stride;
+    if(c->ctor)
+      c->ctor(o);
+    LINK(c, o) = s->free;
+    s->free = o;
+  }
+  return s;
+}
+
+// Move free objects from c's slabs into magazine m,
+// filling it halfway.
+// Caller must hold m->lock.
+static void
+refill(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s;
+  void *o;
+
+  acquire(&c->lock);
+  while(m->n < MAGSIZE/2){
+    if((s = c->partial) == 0){
+      if((s = newslab(c)) == 0)
+        break;
+      slabinsert(c, s);
+    }
+    o = s->free;
+    s->free = LINK(c, o);
+    s->inuse++;
+    if(s->free == 0)
+      slabremove(c, s);
+    m->obj[m->n++] = o;
+  }
+  release(&c->lock);
+}
+
+// Return the last n objects of magazine m to their slabs,
+// freeing slabs that become empty.
+// Caller must hold m->lock.
+static void
+drain(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+  void *o;
+
+  acquire(&c->lock);
+  while(n-- > 0){
+    o = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->cache != c)
+      panic("kmem_cache_free");
+    if(s->free == 0)
+      slabinsert(c, s);
+    LINK(c, o) = s->free;
+    s->free = o;
+    if(--s->inuse == 0){
+      slabremove(c, s);
+      kfree((char*)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c.
+// Returns 0 if there is no memory for it.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *o = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == 0)
+    refill(c, m);
+  else
+    m->hits++;
+  if(m->n > 0)
+    o = m->obj[--m->n];
+  release(&m->lock);
+  pop_off();
+  return o;
+}
+
+// Return object o, which must be in the state
+// c's constructor leaves it in, to c.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE)
+    drain(c, m, MAGSIZE/2);
+  m->obj[m->n++] = o;
+  release(&m->lock);
+  pop_off();
+}
+
+// Add up each CPU's magazine hits, over all caches.
+void
+kmem_cache_stat(struct memstat *ms)
+{
+  struct kmem_cache *c;
+  int i;
+
+  for(c = caches; c; c = c->next){
+    for(i = 0; i < NCPU; i++){
+      acquire(&c->mag[i].lock);
+      ms->cachehits[i] += c->mag[i].hits;
+      release(&c->mag[i].lock);
+    }
+  }
+}
+
+// Empty every CPU's magazines, so that slabs holding
+// only free objects go back to kalloc().
+// Caller must not hold any spinlock.
+void
+kmem_cache_reap(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+
+  for(c = caches; c; c = c->next){
+    for(m = c->mag; m < &c->mag[NCPU]; m++){
+      acquire(&m->lock);
+      drain(c, m, m->n);
+      release(&m->lock);
+    }
+  }
+}
@@ -0,0 +1,25 @@
+// Per-CPU cache of free objects, so that most allocations
+// and frees don't touch the shared slab lists.
+#define MAGSIZE 16
+
+struct magazine {
+  struct spinlock lock;  // only contended by kmem_cache_reap()
+  int n;                 // number of objects in obj[]
+  uint64 hits;           // allocations served without a refill
+  void *obj[MAGSIZE];
+};
+
+// A cache of fixed-size kernel objects, carved out of
+// whole pages (slabs).
+struct kmem_cache {
+  char *name;
+  uint size;             // object size, rounded up
+  uint stride;           // object size plus free-list link
+  uint nobj;             // objects per slab
+  void (*ctor)(void*);   // prepares a newly carved object
+  struct kmem_cache *next;  // list of all caches
+
+  struct spinlock lock;  // protects partial and the slabs
+  struct slab *partial;  // slabs with some free objects
+  struct magazine mag[NCPU];
+};
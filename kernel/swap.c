@@ -0,0 +1,274 @@
+//
+// Paging to a swap area on the disk.
+//
+// The swap area is the SWAPBLOCKS disk blocks that follow the
+// file system, divided into page-sized slots. When free memory
+// runs low, the kswapd kernel process evicts cold user pages to
+// it: a clock hand sweeps over the pages of sleeping processes,
+// giving each page whose PTE_A bit is set a second chance (and
+// clearing the bit), and writing out the first page that hasn't
+// been touched since the hand last passed.
+//
+// An evicted page's PTE is left invalid with PTE_S set, the
+// slot number in place of the physical page number, and the
+// page's permissions kept, so that swapin() can read it back in
+// when the process faults on it. fork() shares slots rather than
+// reading pages in to copy them; each slot has a reference count.
+//
+// Only processes that are SLEEPING are swept, since a runnable
+// process may have been preempted in the kernel while using the
+// physical address of one of its pages. Megapages are never
+// swapped out.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)          // disk blocks per slot
+#define NSLOT (SWAPBLOCKS / SLOTBLOCKS)
+
+// kswapd starts evicting when fewer than SWAPLOW pages are
+// free, and stops once SWAPHIGH are.
+#define SWAPLOW  128
+#define SWAPHIGH 256
+
+// evictone() lets interrupts in after looking at this
+// many pages with a process locked.
+#define SCANBATCH 64
+
+// swapped-out PTE <-> slot number.
+#define SLOT2PTE(s) ((uint64)(s) << 10)
+#define PTE2SLOT(pte) ((pte) >> 10)
+
+extern struct proc proc[NPROC];
+
+struct {
+  // held while evicting or reading in a page, so that a
+  // slot is never reused before its write has finished.
+  struct sleeplock lock;
+  struct buf buf;     // for the disk transfers
+  int hand;           // clock hand: proc[] index
+  uint64 va;          // and user address
+
+  struct spinlock slotlock;
+  uchar ref[NSLOT];   // PTEs referring to each slot
+} swap;
+
+void
+swapinit(void)
+{
+  initsleeplock(&swap.lock, "swap");
+  initlock(&swap.slotlock, "swapslot");
+}
+
+// Allocate a slot, or return -1 if swap is full.
+static int
+slotalloc(void)
+{
+  int i;
+
+  acquire(&swap.slotlock);
+  for(i = 0; i < NSLOT; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      release(&swap.slotlock);
+      return i;
+    }
+  }
+  release(&swap.slotlock);
+  return -1;
+}
+
+static void
+slotput(uint64 slot)
+{
+  acquire(&swap.slotlock);
+  if(slot >= NSLOT || swap.ref[slot] < 1)
+    panic("slotput");
+  swap.ref[slot]--;
+  release(&swap.slotlock);
+}
+
+// Read or write the page at pa from or to a slot.
+// Caller must hold swap.lock.
+static void
+swaprw(uint64 slot, char *pa, int write)
+{
+  int i;
+
+  for(i = 0; i < SLOTBLOCKS; i++){
+    swap.buf.blockno = FSSIZE + slot * SLOTBLOCKS + i;
+    if(write)
+      memmove(swap.buf.data, pa + i*BSIZE, BSIZE);
+    virtio_disk_rw(&swap.buf, write);
+    if(!write)
+      memmove(pa + i*BSIZE, swap.buf.data, BSIZE);
+  }
+}
+
+// Evict one page, where the clock hand finds one.
+// Returns 1 if a page was evicted, 0 if there is
+// none to evict or swap is full.
+// Caller must hold swap.lock.
+static int
+evictone(void)
+{
+  struct proc *p;
+  pte_t *pte;
+  uint64 pa;
+  int i, n, slot;
+
+  // two passes over every process: the first may
+  // only clear PTE_A bits.
+  for(n = 0; n <= 2*NPROC; n++){
+    p = &proc[swap.hand];
+    acquire(&p->lock);
+    for(i = 0; p->state == SLEEPING && swap.va < p->sz; swap.va += PGSIZE){
+      if(++i % SCANBATCH == 0){
+        // p->lock keeps interrupts off; don't hold it
+        // for the whole of a big address space. p may
+        // wake up meanwhile; then move on.
+        release(&p->lock);
+        acquire(&p->lock);
+        if(p->state != SLEEPING || swap.va >= p->sz)
+          break;
+      }
+      if(walkmega(p->pagetable, swap.va)){
+        swap.va = MEGAPGROUNDDOWN(swap.va) + MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      pte = walk(p->pagetable, swap.va, 0);
+      if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        proctlbflush(p);
+        continue;
+      }
+      if((slot = slotalloc()) < 0){
+        release(&p->lock);
+        return 0;
+      }
+      pa = PTE2PA(*pte);
+      *pte = SLOT2PTE(slot) | PTE_S | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D));
+      proctlbflush(p);
+      swap.va += PGSIZE;
+      release(&p->lock);
+      swaprw(slot, (char*)pa, 1);
+      kfree((void*)pa);
+      return 1;
+    }
+    release(&p->lock);
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.va = 0;
+  }
+  return 0;
+}
+
+// Evict up to n pages, to make room for an allocation
+// that failed. Returns the number evicted.
+int
+swapout(int n)
+{
+  int i;
+
+  acquiresleep(&swap.lock);
+  for(i = 0; i < n && evictone(); i++)
+    ;
+  releasesleep(&swap.lock);
+  return i;
+}
+
+// If the page at va in the current process's page table
+// was swapped out, read it back in. Returns 0 if so, -1
+// if it wasn't swapped out or can't be read in.
+int
+swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 slot;
+  char *mem;
+
+  if(va >= MAXVA || walkmega(pagetable, va))
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_S) == 0)
+    return -1;
+
+  acquiresleep(&swap.lock);
+  if((*pte & PTE_S) == 0){
+    // read in while we waited for the lock.
+    releasesleep(&swap.lock);
+    return 0;
+  }
+  while((mem = kalloc()) == 0){
+    if(evictone() == 0){
+      releasesleep(&swap.lock);
+      return -1;
+    }
+  }
+  slot = PTE2SLOT(*pte);
+  swaprw(slot, mem, 0);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_S) | PTE_V;
+  slotput(slot);
+  releasesleep(&swap.lock);
+  proctlbflush(myproc());
+  return 0;
+}
+
+// Another PTE refers to the slot of swapped-out pte.
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.slotlock);
+  if(PTE2SLOT(pte) >= NSLOT || swap.ref[PTE2SLOT(pte)] < 1)
+    panic("swapdup");
+  swap.ref[PTE2SLOT(pte)]++;
+  release(&swap.slotlock);
+}
+
+// Swapped-out pte is being unmapped.
+void
+swapfree(pte_t pte)
+{
+  slotput(PTE2SLOT(pte));
+}
+
+// Fill in the swap part of *ms.
+void
+swapstat(struct memstat *ms)
+{
+  int i;
+
+  ms->swaptotal = NSLOT;
+  ms->swapused = 0;
+  acquire(&swap.slotlock);
+  for(i = 0; i < NSLOT; i++)
+    if(swap.ref[i])
+      ms->swapused++;
+  release(&swap.slotlock);
+}
+
+// The paging daemon: keeps at least SWAPLOW pages free,
+// looking once a tick.
+void
+kswapd(void)
+{
+  uint64 n;
+
+  for(;;){
+    if((n = kfreepages()) < SWAPLOW)
+      swapout(SWAPHIGH - n);
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
@@ -104,6 +104,15 @@ extern uint64 sys_close(void);
 extern uint64 sys_trace(void);              // declare sys_trace function
 extern uint64 sys_waitx(void);              // declare sys_waitx function
 extern uint64 sys_set_priority(void);       // declare sys_set_priority function
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_procmem(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_sync(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -131,12 +140,21 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_trace]   sys_trace,
 [SYS_waitx]   sys_waitx,
-[SYS_set_priority]  sys_set_priority
+[SYS_set_priority]  sys_set_priority,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_memstat] sys_memstat,
+[SYS_procmem] sys_procmem,
+[SYS_spawn]   sys_spawn,
+[SYS_sync]    sys_sync,
 };
 
-char* sysCallName[] = {"","fork","exit","wait","pipe","read","kill","exec","fstat","chdir","dup","getpid","sbrk","sleep","uptime","open","write","mknod","unlink","link","mkdir","close","trace","waitx","set_priority"};
+char* sysCallName[] = {"","fork","exit","wait","pipe","read","kill","exec","fstat","chdir","dup","getpid","sbrk","sleep","uptime","open","write","mknod","unlink","link","mkdir","close","trace","waitx","set_priority","mmap","munmap","shmget","shmat","shmdt","memstat","procmem","spawn","sync"};
 
-int argumentsPerSysCall[] = {0,0,1,1,1,3,1,2,2,1,1,0,1,1,0,2,3,1,2,1,1,3,1,3,2};
+int argumentsPerSysCall[] = {0,0,1,1,1,3,1,2,2,1,1,0,1,1,0,2,3,1,2,1,1,3,1,3,2,6,2,2,1,1,1,2,4,0};
 
 void
 syscall(void)
@@ -156,7 +174,7 @@ syscall(void)
     // and store its return value in p->trapframe->a0
     p->trapframe->a0 = syscalls[num]();
     // printf("%d: syscall %s (%d %d %d) -> %d\n",p->pid, p->name,p->trapframe->a1,p->trapframe->a2,p->trapframe->a3,p->trapframe->a1);
-    int traceMask = p->traceMask;
+    uint64 traceMask = p->traceMask;
     if ((traceMask >> num) & 1) {
       // printf("%d: syscall %s ",p->pid, sysCallName[num]);
       // for(int i=0;i<argumentsPerSysCall[num];i++)
@@ -187,6 +205,10 @@ syscall(void)
         printf("%d: syscall %s (%d %d) -> %d\n", p->pid, sysCallName[num], a0Arg, p->trapframe->a1, p->trapframe->a0);
       else if (argumentsPerSysCall[num] == 3)
         printf("%d: syscall %s (%d %d %d) -> %d\n", p->pid, sysCallName[num], a0Arg, p->trapframe->a1, p->trapframe->a2, p->trapframe->a0);
+      else if (argumentsPerSysCall[num] == 4)
+        printf("%d: syscall %s (%d %d %d %d) -> %d\n", p->pid, sysCallName[num], a0Arg, p->trapframe->a1, p->trapframe->a2, p->trapframe->a3, p->trapframe->a0);
+      else if (argumentsPerSysCall[num] == 6)
+        printf("%d: syscall %s (%d %d %d %d %d %d) -> %d\n", p->pid, sysCallName[num], a0Arg, p->trapframe->a1, p->trapframe->a2, p->trapframe->a3, p->trapframe->a4, p->trapframe->a5, p->trapframe->a0);
     }
   } else {
     printf("%d %s: unknown sys call %d\n",
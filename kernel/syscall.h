@@ -22,4 +22,13 @@
 #define SYS_close  21
 #define SYS_trace  22
 #define SYS_waitx  23
-#define SYS_set_priority 24
\ No newline at end of file
+#define SYS_set_priority 24
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_shmget 27
+#define SYS_shmat  28
+#define SYS_shmdt  29
+#define SYS_memstat 30
+#define SYS_procmem 31
+#define SYS_spawn  32
+#define SYS_sync   33
\ No newline at end of file
@@ -431,20 +431,23 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Fetch the user argument vector at uargv into argv[MAXARG].
+// The strings are packed into one page, which is returned
+// for the caller to kfree(); they have to fit on the new
+// program's one-page stack anyway.
+// Returns 0 on failure.
+static char*
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
-  int i;
-  uint64 uargv, uarg;
+  int i, n;
+  uint64 uarg;
+  char *page, *s;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  if((page = kalloc()) == 0)
+    return 0;
+  s = page;
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -454,24 +457,86 @@ sys_exec(void)
       argv[i] = 0;
       break;
     }
-    argv[i] = kalloc();
-    if(argv[i] == 0)
-      goto bad;
-    if(fetchstr(uarg, argv[i], PGSIZE) < 0)
+    argv[i] = s;
+    if((n = fetchstr(uarg, s, page + PGSIZE - s)) < 0)
       goto bad;
+    s += n + 1;
   }
+  return page;
+
+ bad:
+  kfree(page);
+  return 0;
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG], *page;
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if((page = fetchargv(uargv, argv)) == 0)
+    return -1;
 
   int ret = exec(path, argv);
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+  kfree(page);
+  return ret;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG], *page;
+  int act[2*NOFILE], nact, ret;
+  uint64 uargv, uact;
 
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  argint(3, &nact);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(nact < 0 || nact > NOFILE ||
+     copyin(myproc()->pagetable, (char*)act, uact, nact*2*sizeof(int)) < 0)
+    return -1;
+  if((page = fetchargv(uargv, argv)) == 0)
+    return -1;
+
+  ret = spawn(path, argv, act, nact);
+
+  kfree(page);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
 }
 
 uint64
@@ -503,3 +568,12 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Wait until the updates of finished file system
+// calls are on the disk.
+uint64
+sys_sync(void)
+{
+  log_sync();
+  return 0;
+}
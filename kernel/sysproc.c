@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -48,6 +49,61 @@ sys_sbrk(void)
   return addr;
 }
 
+uint64
+sys_shmget(void)
+{
+  char name[SHMNAME];
+  uint64 size;
+
+  if(argstr(0, name, sizeof(name)) < 0)
+    return -1;
+  argaddr(1, &size);
+  return shmget(name, size);
+}
+
+uint64
+sys_shmat(void)
+{
+  int id;
+
+  argint(0, &id);
+  return shmat(id);
+}
+
+uint64
+sys_shmdt(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdt(addr);
+}
+
+uint64
+sys_memstat(void)
+{
+  uint64 addr;
+  struct memstat ms;
+
+  argaddr(0, &addr);
+  memset(&ms, 0, sizeof(ms));
+  kmemstat(&ms);
+  kmem_cache_stat(&ms);
+  swapstat(&ms);
+  return copyout(myproc()->pagetable, addr, (char*)&ms, sizeof(ms));
+}
+
+uint64
+sys_procmem(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return procmem(addr, n);
+}
+
 uint64
 sys_sleep(void)
 {
@@ -65,6 +65,21 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // instruction, load or store page fault.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+    int access = scause == 12 ? PTE_X : (scause == 13 ? PTE_R : PTE_W);
+
+    // a swapped-out or mmap()ed page may have to be read
+    // from the disk, so allow interrupts as for a system call.
+    intr_on();
+
+    if(swapin(p->pagetable, va) != 0 && mmapfault(p->pagetable, va, access) != 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      setkilled(p);
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -138,7 +153,7 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable) | SATP_ASID(procasid(p));
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
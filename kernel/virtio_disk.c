@@ -196,12 +196,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +211,28 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+static void
+checkv(struct buf **b, int n)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  if(n < 1 || n > MAXIOBLOCKS)
+    panic("virtio_disk_startv");
+  for(int i = 1; i < n; i++){
+    if(b[i]->ioblock != b[0]->ioblock + i)
+      panic("virtio_disk_startv: not contiguous");
+  }
+}
 
-  acquire(&disk.vdisk_lock);
+// format the n+2 descriptors in idx[] as a request for the
+// n bufs in b[], and give it to the device.
+// caller must hold vdisk_lock.
+static void
+submit(int *idx, struct buf **b, int n, int write)
+{
+  int i;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
+  // a descriptor for type/reserved/sector, then descriptors
+  // for the data, then one for a 1-byte status result.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -242,31 +242,37 @@ virtio_disk_rw(struct buf *b, int write)
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
-  buf0->sector = sector;
+  buf0->sector = b[0]->ioblock * (BSIZE / 512);
 
   disk.desc[idx[0]].addr = (uint64) buf0;
   disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) b[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record the struct bufs, linked through qnext,
+  // for virtio_disk_intr().
+  for(i = 0; i < n; i++){
+    b[i]->disk = 1;
+    b[i]->qnext = i+1 < n ? b[i+1] : 0;
+  }
+  disk.info[idx[0]].b = b[0];
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -279,18 +285,74 @@ virtio_disk_rw(struct buf *b, int write)
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// Start reading or writing the n bufs in b[] from or to
+// consecutive blocks of the disk, starting at b[0]->ioblock,
+// as one request, and return
+// without waiting for the disk. Each b[i]->disk stays set until
+// the disk is done with it, and a completed read sets b[i]->valid.
+// The caller must keep the bufs from being reused until then,
+// e.g. by holding their sleeplocks.
+void
+virtio_disk_startv(struct buf **b, int n, int write)
+{
+  int idx[MAXIOBLOCKS+2];
+
+  checkv(b, n);
+  acquire(&disk.vdisk_lock);
+  while(allocn_desc(idx, n+2) != 0)
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  submit(idx, b, n, write);
+  release(&disk.vdisk_lock);
+}
+
+// Like virtio_disk_startv(), but returns -1 rather than
+// sleeping if there aren't enough free descriptors, so
+// that it can be called with spinlocks held.
+int
+virtio_disk_trystart(struct buf **b, int n, int write)
+{
+  int idx[MAXIOBLOCKS+2];
+
+  checkv(b, n);
+  acquire(&disk.vdisk_lock);
+  if(allocn_desc(idx, n+2) != 0){
+    release(&disk.vdisk_lock);
+    return -1;
   }
+  submit(idx, b, n, write);
+  release(&disk.vdisk_lock);
+  return 0;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Start reading or writing b's own block;
+// see virtio_disk_startv().
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  b->ioblock = b->blockno;
+  virtio_disk_startv(&b, 1, write);
+}
 
+// Wait for virtio_disk_intr() to say the disk is done with b.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
@@ -317,11 +379,21 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    disk.info[id].b = 0;
+    free_chain(id);
+    for(; b; b = b->qnext){
+      if(disk.ops[id].type == VIRTIO_BLK_T_IN)
+        b->valid = 1;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  // descriptors are free again; give queued requests
+  // to the device.
+  blkq_dispatch();
 }
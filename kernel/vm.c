@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,6 +17,42 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Process page tables kept ready for reuse, each with just
+// the trampoline mapped, through a level-1 and a level-0
+// page-table page of its own: the level-0 page also holds
+// the trapframe's PTE, which is the only one that differs
+// between processes. Linked through entry 0, which is
+// otherwise unused in a cached page table.
+#define NPTCACHE 16
+
+struct {
+  struct spinlock lock;
+  pagetable_t free;
+  int n;
+} ptcache;
+
+// pages to be given back together by kfreev(), which
+// takes the allocator's lock once for all of them.
+struct freebatch {
+  int n;
+  void *pa[32];
+};
+
+static void
+batchflush(struct freebatch *b)
+{
+  kfreev(b->pa, b->n);
+  b->n = 0;
+}
+
+static void
+batchfree(struct freebatch *b, void *pa)
+{
+  if(b->n == NELEM(b->pa))
+    batchflush(b);
+  b->pa[b->n++] = pa;
+}
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -54,6 +92,7 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&ptcache.lock, "ptcache");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -64,15 +103,42 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // find out how many ASID bits this CPU has: the
+  // unimplemented ones read back as zero. the kernel's
+  // page table uses ASID 0, and processes the others.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xffff));
+  mycpu()->asidmax = (r_satp() >> 44) & 0xffff;
   w_satp(MAKE_SATP(kernel_pagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Split the user megapage mapped by the level-1 PTE *pte
+// into 512 pages mapped by a new level-0 page-table page.
+// Returns 0 on success, -1 if out of memory.
+static int
+splitmega(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa = PTE2PA(*pte);
+  int i;
+
+  if((pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  ksplit((void*)pa);
+  for(i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages, and first split a
+// user megapage containing va into 4096-byte pages; returns
+// 0 if that runs out of memory. If alloc==0, nothing is
+// allocated, and a va in a megapage returns 0 (see walkmega()).
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -91,19 +157,39 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if((*pte & (PTE_R|PTE_W|PTE_X)) &&
+         (level != 1 || !alloc || splitmega(pte) != 0))
+        return 0;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
-// Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// Return the level-1 PTE if va lies in a megapage,
+// or 0. Never allocates or splits anything.
+pte_t *
+walkmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)))
+    return 0;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)) == 0)
+    return 0;
+  return pte;
+}
+
+// Look up a virtual address, return the physical address
+// of its page, or 0 if not mapped.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
@@ -114,6 +200,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if(va >= MAXVA)
     return 0;
 
+  if((pte = walkmega(pagetable, va)) != 0){
+    if((*pte & PTE_U) == 0)
+      return 0;
+    return PTE2PA(*pte) + (PGROUNDDOWN(va) & (MEGAPGSIZE-1));
+  }
+
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     return 0;
@@ -125,14 +217,67 @@ walkaddr(pagetable_t pagetable, uint64 va)
   return pa;
 }
 
+// Map the megapage at va to pa with a leaf PTE in
+// a level-1 page-table page, creating that page if
+// needed. A level-0 page-table page left empty by
+// earlier unmaps is freed and replaced.
+// Returns 0 on success, -1 if out of memory or if
+// part of the megapage is already mapped.
+int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pagetable_t child;
+  pte_t *pte = &pagetable[PX(2, va)];
+  int i;
+
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if((pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return -1;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  pte = &pagetable[PX(1, va)];
+  if(*pte & PTE_V){
+    if(*pte & (PTE_R|PTE_W|PTE_X))
+      return -1;
+    child = (pagetable_t)PTE2PA(*pte);
+    for(i = 0; i < 512; i++){
+      if(child[i] != 0)
+        return -1;
+    }
+    kfree(child);
+  }
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// each megapage-aligned part of the range is mapped with
+// a single megapage PTE, which saves page-table pages and
+// TLB entries for the direct map of RAM.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, end, n;
+
+  end = va + sz;
+  for(a = va; a < end; a += n, pa += n){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+      n = MEGAPGSIZE;
+      if(mapmega(kpgtbl, a, pa, perm) != 0)
+        panic("kvmmap");
+    } else {
+      // up to the next megapage boundary.
+      n = MEGAPGSIZE - a % MEGAPGSIZE;
+      if(n > end - a)
+        n = end - a;
+      if(mappages(kpgtbl, a, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -164,31 +309,69 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Split the user megapage holding va, if there is one and va
+// isn't its start, so that the pages on either side of va can
+// be unmapped separately. If there's no memory for that, make
+// room as growproc() does, and try once more.
+// Returns 0 on success, -1 if there's still no memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  if(va % MEGAPGSIZE == 0 || va >= MAXVA || walkmega(pagetable, va) == 0)
+    return 0;
+  if(walk(pagetable, va, 1) != 0)
+    return 0;
+  // swapout() sleeps, which the caller can't
+  // if it holds a spinlock.
+  if(!intr_get() || swapout(1) == 0 || walk(pagetable, va, 1) == 0)
+    return -1;
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
 // Optionally free the physical memory.
-void
+// Megapages that are only partly unmapped are split; returns
+// -1, having unmapped nothing, if there's no memory for that.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, n, end;
   pte_t *pte;
+  struct freebatch b;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
+  end = va + npages*PGSIZE;
+  if(uvmsplit(pagetable, va) != 0 || uvmsplit(pagetable, end) != 0)
+    return -1;
+
+  b.n = 0;
+  for(a = va; a < end; a += n){
+    n = PGSIZE;
+    if(a % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE &&
+       (pte = walkmega(pagetable, a)) != 0)
+      n = MEGAPGSIZE;
+    else if((pte = walk(pagetable, a, 0)) == 0)
       panic("uvmunmap: walk");
+    if((*pte & PTE_S) && do_free){
+      swapfree(*pte);
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
       panic("uvmunmap: not mapped");
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      batchfree(&b, (void*)pa);
     }
     *pte = 0;
   }
+  batchflush(&b);
+  return 0;
 }
 
 // create an empty user page table.
@@ -197,10 +380,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -214,44 +396,93 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
+// Replace the 512 pages mapped at the megapage-aligned va
+// with a copy in a megapage, if they are all present with the
+// same permissions. Leaves things as they are if not, or if
+// no megapage can be allocated.
+static void
+collapse(pagetable_t pagetable, uint64 va)
+{
+  pagetable_t child;
+  pte_t *pte;
+  char *mem;
+  int i, flags;
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0)
+    return;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)))
+    return;
+  child = (pagetable_t)PTE2PA(*pte);
+  flags = PTE_FLAGS(child[0]) & ~(PTE_A|PTE_D);
+  for(i = 0; i < 512; i++){
+    if((child[i] & PTE_V) == 0 || (PTE_FLAGS(child[i]) & ~(PTE_A|PTE_D)) != flags)
+      return;
+  }
+
+  if((mem = kalloc_pages(MEGAPGORDER)) == 0)
+    return;
+  for(i = 0; i < 512; i++){
+    memmove(mem + i*PGSIZE, (char*)PTE2PA(child[i]), PGSIZE);
+    kfree((void*)PTE2PA(child[i]));
+  }
+  kfree(child);
+  *pte = PA2PTE(mem) | flags;
+}
+
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Megapage-aligned ranges are backed by megapages when they
+// can be allocated, including a range that was begun with
+// 4096-byte pages and that this growth completes.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
   char *mem;
-  uint64 a;
+  uint64 a, n;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
-  for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  for(a = oldsz; a < newsz; a += n){
+    n = PGSIZE;
+    if(a % MEGAPGSIZE == 0 && newsz - a >= MEGAPGSIZE &&
+       (mem = kalloc_pages(MEGAPGORDER)) != 0){
+      memset(mem, 0, MEGAPGSIZE);
+      if(mapmega(pagetable, a, (uint64)mem, PTE_R|PTE_U|xperm) == 0){
+        n = MEGAPGSIZE;
+        continue;
+      }
+      kfree(mem);
+    }
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
   }
+  if(oldsz % MEGAPGSIZE && MEGAPGROUNDDOWN(oldsz) + MEGAPGSIZE <= newsz)
+    collapse(pagetable, MEGAPGROUNDDOWN(oldsz));
   return newsz;
 }
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, which is oldsz
+// if there's no memory to split a megapage that newsz falls in.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -260,30 +491,154 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) != 0)
+      return oldsz;
   }
 
   return newsz;
 }
 
+static void freewalkb(pagetable_t, struct freebatch*);
+
+// Free the page-table pages under *pte, if it
+// points to a lower-level page table.
+static void
+freechild(pte_t *pte, struct freebatch *b)
+{
+  if((*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X)) == 0){
+    freewalkb((pagetable_t)PTE2PA(*pte), b);
+    *pte = 0;
+  } else if(*pte & PTE_V){
+    panic("freewalk: leaf");
+  }
+}
+
+static void
+freewalkb(pagetable_t pagetable, struct freebatch *b)
+{
+  // there are 2^9 = 512 PTEs in a page table.
+  for(int i = 0; i < 512; i++)
+    freechild(&pagetable[i], b);
+  batchfree(b, pagetable);
+}
+
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
 void
 freewalk(pagetable_t pagetable)
 {
-  // there are 2^9 = 512 PTEs in a page table.
-  for(int i = 0; i < 512; i++){
-    pte_t pte = pagetable[i];
-    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
-      // this PTE points to a lower-level page table.
-      uint64 child = PTE2PA(pte);
-      freewalk((pagetable_t)child);
-      pagetable[i] = 0;
-    } else if(pte & PTE_V){
+  struct freebatch b;
+
+  b.n = 0;
+  freewalkb(pagetable, &b);
+  batchflush(&b);
+}
+
+// Create a page table for a process, with no user memory
+// but with the trampoline and the trapframe page at
+// trapframe mapped, from the cache if it has one.
+// Returns 0 if out of memory.
+pagetable_t
+uvmcreateproc(uint64 trapframe)
+{
+  pagetable_t pagetable;
+  pte_t *pte;
+
+  acquire(&ptcache.lock);
+  if((pagetable = ptcache.free) != 0){
+    ptcache.free = (pagetable_t)pagetable[0];
+    ptcache.n--;
+    pagetable[0] = 0;
+  }
+  release(&ptcache.lock);
+
+  if(pagetable == 0){
+    if((pagetable = uvmcreate()) == 0)
+      return 0;
+    // map the trampoline code (for system call return)
+    // at the highest user virtual address.
+    // only the supervisor uses it, on the way
+    // to/from user space, so not PTE_U.
+    if(mappages(pagetable, TRAMPOLINE, PGSIZE,
+                (uint64)trampoline, PTE_R | PTE_X) < 0){
+      freewalk(pagetable);
+      return 0;
+    }
+  }
+
+  // map the trapframe page just below the trampoline page, for
+  // trampoline.S. its PTE is in the trampoline's level-0 page.
+  if((pte = walk(pagetable, TRAPFRAME, 0)) == 0 || *pte != 0)
+    panic("uvmcreateproc");
+  *pte = PA2PTE(trapframe) | PTE_R | PTE_W | PTE_V;
+  return pagetable;
+}
+
+// Free a page table made by uvmcreateproc() and the sz
+// bytes of user memory it maps, keeping the page-table
+// pages that map the trampoline in the cache if it
+// isn't full.
+void
+uvmfreeproc(pagetable_t pagetable, uint64 sz)
+{
+  struct freebatch b;
+  pagetable_t l1, l0;
+  int i;
+
+  if(sz > 0)
+    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+
+  // free every page-table page except the three on the
+  // way to the trampoline.
+  b.n = 0;
+  l1 = (pagetable_t)PTE2PA(pagetable[PX(2, TRAMPOLINE)]);
+  l0 = (pagetable_t)PTE2PA(l1[PX(1, TRAMPOLINE)]);
+  l0[PX(0, TRAPFRAME)] = 0;
+  for(i = 0; i < 512; i++){
+    if(i != PX(2, TRAMPOLINE))
+      freechild(&pagetable[i], &b);
+    if(i != PX(1, TRAMPOLINE))
+      freechild(&l1[i], &b);
+    if(i != PX(0, TRAMPOLINE) && l0[i] != 0)
       panic("freewalk: leaf");
+  }
+  batchflush(&b);
+
+  acquire(&ptcache.lock);
+  if(ptcache.n < NPTCACHE){
+    pagetable[0] = (uint64)ptcache.free;
+    ptcache.free = pagetable;
+    ptcache.n++;
+    pagetable = 0;
+  }
+  release(&ptcache.lock);
+
+  if(pagetable){
+    l0[PX(0, TRAMPOLINE)] = 0;
+    freewalk(pagetable);
+  }
+}
+
+// Free the cached process page tables, when
+// memory runs short.
+void
+uvmreap(void)
+{
+  pagetable_t pagetable;
+
+  for(;;){
+    acquire(&ptcache.lock);
+    if((pagetable = ptcache.free) != 0){
+      ptcache.free = (pagetable_t)pagetable[0];
+      ptcache.n--;
+      pagetable[0] = 0;
     }
+    release(&ptcache.lock);
+    if(pagetable == 0)
+      break;
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    freewalk(pagetable);
   }
-  kfree((void*)pagetable);
 }
 
 // Free user memory pages,
@@ -296,6 +651,82 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+static uint64
+countwalk(pagetable_t pagetable, int level, uint64 *rss, uint64 *swapped)
+{
+  uint64 n = 1, pa;
+  pte_t pte;
+  int i;
+
+  for(i = 0; i < 512; i++){
+    pte = pagetable[i];
+    if((pte & PTE_V) == 0){
+      if(pte & PTE_S)
+        (*swapped)++;
+    } else if((pte & (PTE_R|PTE_W|PTE_X)) == 0){
+      pa = PTE2PA(pte);
+      if(level > 0 && pa >= KERNBASE && pa < PHYSTOP)
+        n += countwalk((pagetable_t)pa, level - 1, rss, swapped);
+    } else if(pte & PTE_U){
+      *rss += 1L << (9*level);
+    }
+  }
+  return n;
+}
+
+// Add the user pages mapped by pagetable (a megapage
+// counts as 512) to *rss and the swapped-out ones to
+// *swapped, and return the number of page-table pages.
+// The table may be another process's and change as it is
+// counted, making the counts approximate; a page-table
+// page freed meanwhile is never followed outside of RAM.
+uint64
+uvmstat(pagetable_t pagetable, uint64 *rss, uint64 *swapped)
+{
+  return countwalk(pagetable, 2, rss, swapped);
+}
+
+// Copy the megapage mapped at va in old to new, into a
+// megapage if one can be allocated, or else into 4096-byte
+// pages. Returns 0 on success, -1 if out of memory, in
+// which case nothing is left mapped at va in new.
+int
+copymega(pagetable_t old, pagetable_t new, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, a;
+  int flags;
+  char *mem;
+
+  if((pte = walkmega(old, va)) == 0)
+    panic("copymega");
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~(PTE_A|PTE_D);
+
+  if((mem = kalloc_pages(MEGAPGORDER)) != 0){
+    memmove(mem, (char*)pa, MEGAPGSIZE);
+    if(mapmega(new, va, (uint64)mem, flags) == 0)
+      return 0;
+    kfree(mem);
+  }
+
+  for(a = 0; a < MEGAPGSIZE; a += PGSIZE){
+    if((mem = kalloc()) == 0)
+      goto err;
+    memmove(mem, (char*)(pa + a), PGSIZE);
+    if(mappages(new, va + a, PGSIZE, (uint64)mem, flags) != 0){
+      kfree(mem);
+      goto err;
+    }
+  }
+  return 0;
+
+ err:
+  if(a > 0)
+    uvmunmap(new, va, a / PGSIZE, 1);
+  return -1;
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
 // Copies both the page table and the
@@ -305,14 +736,30 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  pte_t *pte, *npte;
+  uint64 pa, i, n;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = 0; i < sz; i += n){
+    n = PGSIZE;
+    if(walkmega(old, i)){
+      if(copymega(old, new, i) != 0)
+        goto err;
+      n = MEGAPGSIZE;
+      continue;
+    }
     if((pte = walk(old, i, 0)) == 0)
       panic("uvmcopy: pte should exist");
+    if(*pte & PTE_S){
+      // share the slot; whichever process touches the
+      // page first reads it into a page of its own.
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      swapdup(*pte);
+      *npte = *pte;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
       panic("uvmcopy: page not present");
     pa = PTE2PA(*pte);
@@ -334,15 +781,94 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
-void
+// splits a megapage holding va; returns -1 if
+// there's no memory for that.
+int
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    panic("uvmclear");
+  if((pte = walk(pagetable, va, 1)) == 0)
+    return -1;
   *pte &= ~PTE_U;
+  return 0;
+}
+
+// Look up user virtual address va for a kernel copy that needs
+// PTE permission access (PTE_R or PTE_W), populating an mmap()ed
+// page on first touch. Marks the PTE accessed, and dirty for a
+// write, as the hardware would for a user access.
+// Returns the physical address of va, or 0, and sets *span to
+// the number of bytes from va to the end of its page or
+// megapage, which are physically contiguous.
+// A copy looks up consecutive pages, and *last remembers the
+// PTE of the previous one (0 at first), so that a page in the
+// same page-table page is found without a walk from the root.
+static uint64
+uvmtouch(pagetable_t pagetable, uint64 va, int access, pte_t **last, uint64 *span)
+{
+  pte_t *pte;
+  uint64 pa;
+  int mega = 0;
+
+  if(va >= MAXVA)
+    return 0;
+  if(*last && PX(0, va) != 0 && ((*last)[1] & PTE_V)){
+    pte = *last + 1;
+    pa = PTE2PA(*pte) + (va % PGSIZE);
+    *span = PGSIZE - va % PGSIZE;
+  } else if((pte = walkmega(pagetable, va)) != 0){
+    pa = PTE2PA(*pte) + (va % MEGAPGSIZE);
+    *span = MEGAPGSIZE - va % MEGAPGSIZE;
+    mega = 1;
+  } else {
+    pte = walk(pagetable, va, 0);
+    if(pte && (*pte & PTE_S)){
+      // swapin() may sleep, which the caller can't
+      // if it holds a spinlock.
+      if(!intr_get() || swapin(pagetable, va) != 0)
+        return 0;
+      *last = 0;
+      return uvmtouch(pagetable, va, access, last, span);
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      if(mmapfault(pagetable, va, access) != 0)
+        return 0;
+      *last = 0;
+      return uvmtouch(pagetable, va, access, last, span);
+    }
+    pa = PTE2PA(*pte) + (va % PGSIZE);
+    *span = PGSIZE - va % PGSIZE;
+  }
+  if((*pte & PTE_U) == 0 || (*pte & access) == 0)
+    return 0;
+  *pte |= PTE_A;
+  if(access & PTE_W)
+    *pte |= PTE_D;
+  *last = mega ? 0 : pte;
+  return pa;
+}
+
+// Make the user pages of [va, va+len) present for access,
+// reading swapped-out pages back in and populating mmap()ed
+// ones, so that a copy can then be done with spinlocks held.
+// Returns 0, or -1 if some page can't be accessed.
+// Caller must not hold a spinlock.
+int
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int access)
+{
+  uint64 n;
+  pte_t *last = 0;
+
+  while(len > 0){
+    if(uvmtouch(pagetable, va, access, &last, &n) == 0)
+      return -1;
+    if(n > len)
+      n = len;
+    va += n;
+    len -= n;
+  }
+  return 0;
 }
 
 // Copy from kernel to user.
@@ -351,21 +877,20 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
+  pte_t *last = 0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa = uvmtouch(pagetable, dstva, PTE_W, &last, &n);
+    if(pa == 0)
       return -1;
-    n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    memmove((void *)pa, src, n);
 
     len -= n;
     src += n;
-    dstva = va0 + PGSIZE;
+    dstva += n;
   }
   return 0;
 }
@@ -376,21 +901,20 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
+  pte_t *last = 0;
 
   while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa = uvmtouch(pagetable, srcva, PTE_R, &last, &n);
+    if(pa == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    memmove(dst, (void *)pa, n);
 
     len -= n;
     dst += n;
-    srcva = va0 + PGSIZE;
+    srcva += n;
   }
   return 0;
 }
@@ -402,19 +926,19 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, pa;
+  pte_t *last = 0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa = uvmtouch(pagetable, srcva, PTE_R, &last, &n);
+    if(pa == 0)
       return -1;
-    n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
+    srcva += n;
 
-    char *p = (char *) (pa0 + (srcva - va0));
+    char *p = (char *) pa;
     while(n > 0){
       if(*p == '\0'){
         *dst = '\0';
@@ -428,8 +952,6 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
-
-    srcva = va0 + PGSIZE;
   }
   if(got_null){
     return 0;
@@ -0,0 +1,29 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// print the system's memory usage, in kilobytes.
+int
+main(int argc, char *argv[])
+{
+  struct memstat ms;
+  int i;
+
+  if(memstat(&ms) < 0){
+    fprintf(2, "free: memstat failed\n");
+    exit(1);
+  }
+  printf("\ttotal\tused\tfree\tzeroed\n");
+  printf("mem:\t%d\t%d\t%d\t%d\n", (int)ms.total*4, (int)(ms.total - ms.free)*4,
+         (int)ms.free*4, (int)ms.zeroed*4);
+  printf("swap:\t%d\t%d\t%d\n", (int)ms.swaptotal*4, (int)ms.swapused*4,
+         (int)(ms.swaptotal - ms.swapused)*4);
+  printf("allocs %d, failed %d\n", (int)ms.allocs, (int)ms.fails);
+  printf("slab magazine hits:");
+  for(i = 0; i < NCPU; i++)
+    if(ms.cachehits[i])
+      printf(" cpu%d %d", i, (int)ms.cachehits[i]);
+  printf("\n");
+  exit(0);
+}
@@ -0,0 +1,30 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// list processes and their memory use, in kilobytes.
+
+static char *states[] = {
+  "unused", "used", "sleep", "runble", "run", "zombie"
+};
+
+int
+main(int argc, char *argv[])
+{
+  static struct procmem pm[NPROC];
+  char *state;
+  int i, n;
+
+  if((n = procmem(pm, NPROC)) < 0){
+    fprintf(2, "ps: procmem failed\n");
+    exit(1);
+  }
+  printf("PID\tSTATE\tSIZE\tRSS\tSWAP\tPT\tNAME\n");
+  for(i = 0; i < n; i++){
+    state = pm[i].state >= 0 && pm[i].state < sizeof(states)/sizeof(states[0]) ? states[pm[i].state] : "???";
+    printf("%d\t%s\t%d\t%d\t%d\t%d\t%s\n", pm[i].pid, state, (int)pm[i].sz/1024,
+           (int)pm[i].rss*4, (int)pm[i].swapped*4, (int)pm[i].ptpages*4, pm[i].name);
+  }
+  exit(0);
+}
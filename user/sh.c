@@ -12,6 +12,9 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define MAXREDIR 4  // redirections of a spawned command
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 
 struct cmd {
   int type;
@@ -53,6 +56,7 @@ int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
+int gettoken(char**, char*, char**, char**);
 
 // Execute cmd.  Never returns.
 void
@@ -131,6 +135,146 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Whether the command line s is a pipeline of programs
+// with redirections, which parsecmd() parses without error
+// and spawncmd() runs without forking the shell.
+int
+simple(char *s)
+{
+  char *es = s + strlen(s);
+  int tok, nargs = 0;
+
+  while((tok = gettoken(&s, es, 0, 0)) != 0){
+    switch(tok){
+    case 'a':
+      if(++nargs >= MAXARGS)
+        return 0;
+      break;
+    case '<':
+    case '>':
+    case '+':
+      if(gettoken(&s, es, 0, 0) != 'a')
+        return 0;
+      break;
+    case '|':
+      if(nargs == 0)
+        return 0;
+      nargs = 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return nargs > 0;
+}
+
+// Start cmd, a program with redirections, reading fd0 and
+// writing fd1 where they aren't -1 and with fd other closed.
+// spawn() starts it without copying the shell; if that fails,
+// fork and let runcmd() do it, and report the error.
+void
+spawn1(struct cmd *cmd, int fd0, int fd1, int other)
+{
+  int act[2*(5+2*MAXREDIR)], fds[MAXREDIR];
+  int n = 0, nfd = 0, ok = 1, i;
+  struct redircmd *rcmd;
+  struct cmd *c;
+
+  if(fd0 >= 0){
+    act[n++] = 0; act[n++] = fd0;
+    act[n++] = fd0; act[n++] = -1;
+  }
+  if(fd1 >= 0){
+    act[n++] = 1; act[n++] = fd1;
+    act[n++] = fd1; act[n++] = -1;
+  }
+  if(other >= 0){
+    act[n++] = other; act[n++] = -1;
+  }
+  for(c = cmd; c->type == REDIR; c = rcmd->cmd){
+    rcmd = (struct redircmd*)c;
+    if(nfd == MAXREDIR || n + 4 > NELEM(act) ||
+       (fds[nfd] = open(rcmd->file, rcmd->mode)) < 0){
+      ok = 0;
+      break;
+    }
+    act[n++] = rcmd->fd; act[n++] = fds[nfd];
+    act[n++] = fds[nfd]; act[n++] = -1;
+    nfd++;
+  }
+  if(ok)
+    ok = spawn(((struct execcmd*)c)->argv[0], ((struct execcmd*)c)->argv, act, n/2) >= 0;
+  for(i = 0; i < nfd; i++)
+    close(fds[i]);
+  if(ok)
+    return;
+
+  if(fork1() == 0){
+    if(fd0 >= 0){
+      close(0);
+      dup(fd0);
+      close(fd0);
+    }
+    if(fd1 >= 0){
+      close(1);
+      dup(fd1);
+      close(fd1);
+    }
+    if(other >= 0)
+      close(other);
+    runcmd(cmd);
+  }
+}
+
+// Start the programs of cmd, a pipeline for which simple()
+// holds, the first reading fd0 if it isn't -1, which is
+// then closed. Returns the number of processes started.
+int
+spawncmd(struct cmd *cmd, int fd0)
+{
+  struct pipecmd *pcmd;
+  int p[2];
+
+  if(cmd->type != PIPE){
+    spawn1(cmd, fd0, -1, -1);
+    if(fd0 >= 0)
+      close(fd0);
+    return 1;
+  }
+  pcmd = (struct pipecmd*)cmd;
+  if(pipe(p) < 0)
+    panic("pipe");
+  spawn1(pcmd->left, fd0, p[1], p[0]);
+  if(fd0 >= 0)
+    close(fd0);
+  close(p[1]);
+  return 1 + spawncmd(pcmd->right, p[0]);
+}
+
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+  case PIPE:
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+  case LIST:
+    freecmd(((struct listcmd*)cmd)->left);
+    freecmd(((struct listcmd*)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,7 +290,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -165,6 +310,15 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(simple(buf)){
+      // parsed here, since it can't fail, and started
+      // without a copy of the shell.
+      cmd = parsecmd(buf);
+      for(n = spawncmd(cmd, -1); n > 0; n--)
+        wait(0);
+      freecmd(cmd);
+      continue;
+    }
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
@@ -1,4 +1,6 @@
 struct stat;
+struct memstat;
+struct procmem;
 
 // system calls
 int fork(void);
@@ -25,6 +27,15 @@ int uptime(void);
 int trace(int);
 int waitx(int*, int*, int*);
 int set_priority(int, int);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int shmget(const char*, uint64);
+void* shmat(int);
+int shmdt(void*);
+int memstat(struct memstat*);
+int procmem(struct procmem*, int);
+int spawn(const char*, char**, int*, int);
+int sync(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
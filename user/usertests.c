@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1918,12 +1919,13 @@ dirfile(char *s)
 
 // test that iput() is called at the end of _namei().
 // also tests empty file names.
+#define NIREF 51
 void
 iref(char *s)
 {
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < NIREF; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1945,7 +1947,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < NIREF; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -2554,7 +2556,485 @@ sbrk8000(char *s)
   *(top-1) = *(top-1) + 1;
 }
 
+// mmap() anonymous and file-backed regions, write-back of
+// MAP_SHARED pages, sharing across fork(), and munmap().
+void
+mmaptest(char *s)
+{
+  enum { N = 3*4096 };
+  char *p;
+  int fd, i, pid, xstatus;
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 0 || p[N-1] != 0){
+    printf("%s: anonymous mapping not zeroed\n", s);
+    exit(1);
+  }
+  p[0] = 'a';
+  p[N-1] = 'b';
+  if(munmap(p, N) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = 'A' + i % 26;
+  if(write(fd, buf, N) != N){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+
+  // writes to a private mapping must not reach the file.
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || memcmp(p, buf, N) != 0){
+    printf("%s: private file mapping wrong\n", s);
+    exit(1);
+  }
+  p[0] = 'x';
+  munmap(p, N);
+
+  p = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1 || p[0] != 'A'){
+    printf("%s: shared file mapping wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // a child's writes to an inherited shared mapping are
+  // visible to the parent.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[1] = 'y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[1] != 'y'){
+    printf("%s: shared mapping not shared with child\n", s);
+    exit(1);
+  }
+  p[4096] = 'z';
+  munmap(p, N);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, N) != N){
+    printf("%s: reread mmapfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[0] != 'A' || buf[1] != 'y' || buf[4096] != 'z'){
+    printf("%s: shared mapping not written back\n", s);
+    exit(1);
+  }
+  unlink("mmapfile");
+
+  // the unmapped region must now fault.
+  pid = fork();
+  if(pid == 0){
+    p[0] = 'q';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: access after munmap did not fault\n", s);
+    exit(1);
+  }
+}
+
+// shared memory segments: a segment attached by name in
+// two processes is the same memory.
+void
+shmtest(char *s)
+{
+  enum { N = 2*4096 };
+  int i, id, id0, pid, xstatus;
+  char *p, name[] = "shmtest.";
+
+  if((id = shmget("shmtest", N)) < 0){
+    printf("%s: shmget failed\n", s);
+    exit(1);
+  }
+  if((p = shmat(id)) == (char*)-1){
+    printf("%s: shmat failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 0 || p[N-1] != 0){
+    printf("%s: segment not zeroed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // detach the inherited region and attach afresh by name.
+    if(shmdt(p) < 0)
+      exit(1);
+    if((id = shmget("shmtest", N)) < 0 || (p = shmat(id)) == (char*)-1)
+      exit(1);
+    p[0] = 'c';
+    p[N-1] = 'd';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'c' || p[N-1] != 'd'){
+    printf("%s: child's writes not visible\n", s);
+    exit(1);
+  }
+  if(shmget("shmtest", 2*N) >= 0){
+    printf("%s: shmget grew an existing segment\n", s);
+    exit(1);
+  }
+  if(shmdt(p) < 0 || shmdt(p) == 0){
+    printf("%s: shmdt wrong\n", s);
+    exit(1);
+  }
+
+  // segments that are never attached don't use up the table,
+  // and a stale id doesn't attach a newer segment in its slot.
+  for(i = 0; i < 2*NSHM; i++){
+    name[7] = 'a' + i;
+    if((id = shmget(name, N)) < 0){
+      printf("%s: shmget %d failed\n", s, i);
+      exit(1);
+    }
+    if(i == 0)
+      id0 = id;
+  }
+  if(shmat(id0) != (char*)-1){
+    printf("%s: shmat of a freed segment succeeded\n", s);
+    exit(1);
+  }
+}
+
+// a heap and an anonymous mapping big enough for megapages
+// keep their contents across fork() and partial unmapping.
+void
+hugetest(char *s)
+{
+  enum { MEGA = 512*4096, N = 3*MEGA };
+  char *a, *p, *q;
+  int i, n, pid, xstatus;
+
+  a = sbrk(0);
+  // start the heap on a megapage boundary so that the
+  // pages that get there first are collapsed.
+  if(sbrk((MEGA - (uint64)a % MEGA) % MEGA + 4096) == (char*)-1 ||
+     (p = sbrk(N)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += 4096)
+    p[i] = i / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += 4096)
+      if(p[i] != (char)(i / 4096))
+        exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong heap\n", s);
+    exit(1);
+  }
+
+  // shrink into the middle of a megapage.
+  sbrk(-(MEGA + MEGA/2));
+  for(i = 0; i < N - MEGA - MEGA/2; i += 4096){
+    if(p[i] != (char)(i / 4096)){
+      printf("%s: heap wrong after shrinking\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-(N - MEGA - MEGA/2));
+  sbrk(-((MEGA - (uint64)a % MEGA) % MEGA + 4096));
+
+  q = mmap(0, 2*MEGA, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(q == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*MEGA; i += 4096)
+    q[i] = i / 4096;
+  if(munmap(q + MEGA/2, 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*MEGA; i += 4096){
+    if(i != MEGA/2 && q[i] != (char)(i / 4096)){
+      printf("%s: mapping wrong after munmap\n", s);
+      exit(1);
+    }
+  }
+  munmap(q, MEGA/2);
+  munmap(q + MEGA/2 + 4096, 2*MEGA - MEGA/2 - 4096);
+
+  // shrinking into a megapage takes a page to split it. with
+  // memory full, that either makes room or fails cleanly.
+  a = sbrk(0);
+  if(sbrk((MEGA - (uint64)a % MEGA) % MEGA) == (char*)-1 ||
+     (p = sbrk(MEGA)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < MEGA; i += 4096)
+    p[i] = i / 4096;
+  for(n = 0; sbrk(64*4096) != (char*)-1; n += 64*4096)
+    ;
+  for(; sbrk(4096) != (char*)-1; n += 4096)
+    ;
+  if(sbrk(-(n + MEGA/2)) == (char*)-1){
+    // give back the rest first.
+    if(sbrk(-n) == (char*)-1 || sbrk(-MEGA/2) == (char*)-1){
+      printf("%s: can't shrink into a megapage\n", s);
+      exit(1);
+    }
+  }
+  if(sbrk(0) != p + MEGA/2){
+    printf("%s: wrong size after shrinking\n", s);
+    exit(1);
+  }
+  for(i = 0; i < MEGA/2; i += 4096){
+    if(p[i] != (char)(i / 4096)){
+      printf("%s: heap wrong after shrinking with memory full\n", s);
+      exit(1);
+    }
+  }
+}
+
+
+// memstat() sees pages go and come back, and procmem()
+// counts this process's pages.
+void
+memstattest(char *s)
+{
+  enum { N = 64*4096 };
+  struct memstat ms0, ms1;
+  static struct procmem pm[NPROC];
+  int i, n, pid;
+
+  if(memstat(&ms0) < 0 || ms0.free == 0 || ms0.free > ms0.total){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  if(sbrk(N) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  memstat(&ms1);
+  if(ms1.allocs < ms0.allocs + N/4096){
+    printf("%s: allocs %d -> %d\n", s, (int)ms0.allocs, (int)ms1.allocs);
+    exit(1);
+  }
+
+  pid = getpid();
+  if((n = procmem(pm, NPROC)) <= 0){
+    printf("%s: procmem failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++)
+    if(pm[i].pid == pid)
+      break;
+  if(i == n || pm[i].rss < N/4096 || pm[i].ptpages < 3){
+    printf("%s: procmem doesn't count this process\n", s);
+    exit(1);
+  }
+  sbrk(-N);
+}
+
+// spawn() starts a program with its output redirected,
+// and fails cleanly for a bad path or fd.
+void
+spawntest(char *s)
+{
+  char *argv[] = { "echo", "spawned", 0 };
+  int fds[2], act[2], pid, xstatus, n;
+  char buf[32];
 
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  act[0] = 1;
+  act[1] = fds[1];
+  if((pid = spawn("echo", argv, act, 1)) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  n = read(fds[0], buf, sizeof(buf) - 1);
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0 || n != 8 || memcmp(buf, "spawned\n", 8) != 0){
+    printf("%s: spawned echo wrote the wrong thing\n", s);
+    exit(1);
+  }
+
+  if(spawn("nonexistent", argv, 0, 0) >= 0){
+    printf("%s: spawned a nonexistent program\n", s);
+    exit(1);
+  }
+  act[0] = 1;
+  act[1] = NOFILE - 1;
+  if(spawn("echo", argv, act, 1) >= 0){
+    printf("%s: spawn with a bad fd succeeded\n", s);
+    exit(1);
+  }
+
+  // sh spawns the middle stage of a pipeline with
+  // as many redirections as it allows.
+  char *shargv[] = { "sh", 0 };
+  char *script = "echo x | cat <spawn.a >spawn.b <spawn.a >spawn.c | cat\n";
+  int fd;
+
+  unlink("spawn.b");
+  if((fd = open("spawn.a", O_CREATE|O_WRONLY|O_TRUNC)) < 0 ||
+     write(fd, "abc\n", 4) != 4 || close(fd) < 0 ||
+     (fd = open("spawn.sh", O_CREATE|O_WRONLY|O_TRUNC)) < 0 ||
+     write(fd, script, strlen(script)) != strlen(script) || close(fd) < 0){
+    printf("%s: can't write the script\n", s);
+    exit(1);
+  }
+  if((pid = fork()) == 0){
+    // read commands from the script, and throw away
+    // the prompts.
+    close(0);
+    open("spawn.sh", O_RDONLY);
+    close(2);
+    dup(0);
+    exec("sh", shargv);
+    exit(1);
+  }
+  if(pid < 0 || wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: sh failed\n", s);
+    exit(1);
+  }
+  fd = open("spawn.b", O_RDONLY);
+  n = fd < 0 ? -1 : read(fd, buf, sizeof(buf));
+  close(fd);
+  unlink("spawn.a");
+  unlink("spawn.b");
+  unlink("spawn.c");
+  unlink("spawn.sh");
+  if(n != 4 || memcmp(buf, "abc\n", 4) != 0){
+    printf("%s: redirected pipeline stage wrote the wrong thing\n", s);
+    exit(1);
+  }
+}
+
+// a sleeping process's pages survive being swapped out to
+// make room for another process that uses up all memory.
+void
+swaptest(char *s)
+{
+  enum { N = 256*4096, STEP = 1024*1024 };
+  int ready[2], go[2], i, pid, xstatus;
+  uint64 n;
+  char *p, c;
+
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((p = sbrk(N)) == (char*)-1)
+      exit(1);
+    for(i = 0; i < N; i += 4096)
+      p[i] = i / 4096;
+    write(ready[1], "x", 1);
+    read(go[0], &c, 1);
+    for(i = 0; i < N; i += 4096)
+      if(p[i] != (char)(i / 4096))
+        exit(1);
+    exit(0);
+  }
+
+  read(ready[0], &c, 1);
+  for(n = 0; sbrk(STEP) != (char*)-1; n += STEP)
+    ;
+  sbrk(-n);
+  write(go[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child's memory wrong after swapping\n", s);
+    exit(1);
+  }
+}
+
+// sync() waits for the writes of finished system calls,
+// from several processes at once, and works with nothing
+// left to write.
+void
+synctest(char *s)
+{
+  enum { N = 4 };
+  char name[] = "sync.0", buf[8];
+  int i, fd, pid, xstatus;
+
+  for(i = 0; i < N; i++){
+    name[5] = '0' + i;
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+        exit(1);
+      if(write(fd, name, sizeof(name)) != sizeof(name))
+        exit(1);
+      close(fd);
+      exit(sync() < 0);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  if(sync() < 0 || sync() < 0){
+    printf("%s: sync failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[5] = '0' + i;
+    if((fd = open(name, O_RDONLY)) < 0 ||
+       read(fd, buf, sizeof(buf)) != sizeof(name) ||
+       strcmp(buf, name) != 0){
+      printf("%s: %s wrong\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    unlink(name);
+  }
+}
 
 // regression test. test whether exec() leaks memory if one of the
 // arguments is invalid. the test passes if the kernel doesn't panic.
@@ -2634,6 +3114,12 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {mmaptest, "mmaptest"},
+  {shmtest, "shmtest"},
+  {hugetest, "hugetest"},
+  {memstattest, "memstattest"},
+  {spawntest, "spawntest"},
+  {synctest, "synctest"},
   {badarg, "badarg" },
 
   { 0, 0},
@@ -2931,6 +3417,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swaptest"},
     
   { 0, 0},
 };
@@ -38,4 +38,13 @@ entry("sleep");
 entry("uptime");
 entry("trace");
 entry("waitx");
-entry("set_priority") 
\ No newline at end of file
+entry("set_priority");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("memstat");
+entry("procmem");
+entry("spawn");
+entry("sync");